@@ -0,0 +1,551 @@
+#include "game.h"
+
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace {
+
+struct Result
+{
+	std::string name;
+	double ms;
+	int runs;
+	size_t items;
+};
+
+std::vector<Result> results;
+
+void Report(const std::string& name, double ms, int runs, size_t items)
+{
+	results.push_back({ name, ms, runs, items });
+	std::cerr << name << ": " << ms << " ms\n";
+}
+
+template <class FN>
+double TimeMs(int runs, const FN& fn)
+{
+	double best = 1e30;
+	for (int i = 0; i < runs; ++i) {
+		const uint64_t start = stm_now();
+		fn();
+		best = std::min(best, stm_ms(stm_since(start)));
+	}
+	return best;
+}
+
+// fn returns how many items it went through, vertices, samples, tiles...
+template <class FN>
+void Bench(const std::string& name, int runs, const FN& fn)
+{
+	size_t items = 0;
+	const double ms = TimeMs(runs, [&] { items = fn(); });
+	Report(name, ms, runs, items);
+}
+
+// grid of side*side vertices with position, normal and uv, two triangles per cell
+bool WriteGridPLY(const std::string& path, int side, bool binary)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		return false;
+
+	const int vcount = side * side;
+	const int fcount = 2 * (side - 1) * (side - 1);
+	out << "ply\n"
+		<< "format " << (binary ? "binary_little_endian" : "ascii") << " 1.0\n"
+		<< "comment pipoengine bench\n"
+		<< "element vertex " << vcount << "\n"
+		<< "property float x\nproperty float y\nproperty float z\n"
+		<< "property float nx\nproperty float ny\nproperty float nz\n"
+		<< "property float s\nproperty float t\n"
+		<< "element face " << fcount << "\n"
+		<< "property list uchar int vertex_indices\n"
+		<< "end_header\n";
+
+	for (int y = 0; y < side; ++y) {
+		for (int x = 0; x < side; ++x) {
+			const float v[8] = {
+				float(x), float(y), 0.01f * float((x * 7 + y * 13) % 100),
+				0.0f, 0.0f, 1.0f,
+				float(x) / float(side - 1), float(y) / float(side - 1),
+			};
+			if (binary)
+				out.write(reinterpret_cast<const char*>(v), sizeof(v));
+			else
+				out << v[0] << ' ' << v[1] << ' ' << v[2] << ' ' << v[3] << ' ' << v[4] << ' ' << v[5] << ' ' << v[6] << ' ' << v[7] << '\n';
+		}
+	}
+
+	for (int y = 0; y < side - 1; ++y) {
+		for (int x = 0; x < side - 1; ++x) {
+			const int i0 = y * side + x;
+			const int tris[2][3] = { { i0, i0 + 1, i0 + side }, { i0 + 1, i0 + side + 1, i0 + side } };
+			for (const auto& t : tris) {
+				if (binary) {
+					const uint8_t n = 3;
+					out.write(reinterpret_cast<const char*>(&n), 1);
+					out.write(reinterpret_cast<const char*>(t), sizeof(t));
+				} else {
+					out << "3 " << t[0] << ' ' << t[1] << ' ' << t[2] << '\n';
+				}
+			}
+		}
+	}
+
+	return bool(out);
+}
+
+// the ascii parser LoadMesh used before the mmap/from_chars rewrite, kept as a reference point
+std::optional<pe::MeshData> LegacyParsePLY(std::string_view path)
+{
+	std::ifstream in(path.data());
+	if (!in)
+		return {};
+
+	enum Cmp {
+		px, py, pz, nx, ny, nz, u, v, r, g, b, a, count,
+	};
+
+	const std::map<std::string, Cmp> idToCmp = {
+		{ "x", px }, { "y", py }, { "z", pz },
+		{ "nx", nx }, { "ny", ny }, { "nz", nz },
+		{ "s", u }, { "t", v },
+	};
+
+	std::vector<std::pair<int, std::vector<Cmp>>> format;
+	char buffer[512];
+
+	while (in.getline(buffer, sizeof(buffer))) {
+		if (strncmp(buffer, "element", 7) == 0) {
+			std::istringstream str(buffer + 8);
+			std::string type, count;
+			str >> type >> count;
+			format.push_back({ std::stoi(count), {} });
+		} else if (strncmp(buffer, "property", 8) == 0) {
+			std::istringstream str(buffer + 9);
+			std::string fmt, cmp;
+			str >> fmt >> cmp;
+			auto itf = idToCmp.find(cmp);
+			if (itf != idToCmp.end())
+				format.back().second.push_back(itf->second);
+		} else if (strncmp(buffer, "end_header", 10) == 0) {
+			break;
+		}
+	}
+
+	if (format.size() != 2)
+		return {};
+
+	pe::MeshData mesh;
+	{
+		const auto& part = format[0];
+		mesh.vertice.reserve(part.first);
+		std::array<float, count> data;
+		std::string item;
+		for (int i = 0; i < part.first; ++i) {
+			if (!in.getline(buffer, sizeof(buffer)))
+				return {};
+			std::istringstream str(buffer);
+			std::fill(data.begin(), data.end(), 0.5f);
+			for (Cmp cmp : part.second) {
+				str >> item;
+				data[cmp] = stof(item);
+			}
+			mesh.vertice.push_back({
+				{ data[px], data[py], data[pz] },
+				{ data[nx], data[ny], data[nz] },
+				{ data[u], data[v] },
+				{ 0xff00ff00 },
+			});
+		}
+	}
+	{
+		const auto& part = format[1];
+		mesh.indice.reserve(3 * part.first);
+		std::string c, v0, v1, v2;
+		for (int i = 0; i < part.first; ++i) {
+			if (!in.getline(buffer, sizeof(buffer)))
+				return {};
+			std::istringstream str(buffer);
+			str >> c >> v0 >> v1 >> v2;
+			mesh.indice.push_back(std::stoi(v0));
+			mesh.indice.push_back(std::stoi(v1));
+			mesh.indice.push_back(std::stoi(v2));
+		}
+	}
+	return mesh;
+}
+
+// grid of side*side vertices, binary since that is what the cooker sees most
+void BenchPLY(int side, int runs)
+{
+	const std::string asciiPath = "bench_ascii.ply";
+	const std::string binaryPath = "bench_binary.ply";
+	if (!WriteGridPLY(asciiPath, side, false) || !WriteGridPLY(binaryPath, side, true)) {
+		std::cerr << "cannot write bench files\n";
+		return;
+	}
+
+	Bench("ParsePLY/legacy_ascii", runs, [&] { return LegacyParsePLY(asciiPath)->vertice.size(); });
+	Bench("ParsePLY/ascii", runs, [&] { return pe::ParsePLY(asciiPath)->vertice.size(); });
+	Bench("ParsePLY/binary", runs, [&] { return pe::ParsePLY(binaryPath)->vertice.size(); });
+
+	// regenerated even though the grid has normals, to weigh them against ParsePLY/binary
+	pe::JobSystem jobs;
+	pe::MeshData mesh = *pe::ParsePLY(binaryPath);
+	Bench("ComputeNormals", runs, [&] {
+		pe::ComputeNormals(mesh, &jobs);
+		return mesh.vertice.size();
+	});
+	Bench("ComputeTangents", runs, [&] {
+		pe::ComputeTangents(mesh, &jobs);
+		return mesh.vertice.size();
+	});
+
+	std::remove(asciiPath.c_str());
+	std::remove(binaryPath.c_str());
+}
+
+// 22x22 tiles of 25x25 samples over a 512x512 map, like Game::init
+void BenchBuildHMap(int runs)
+{
+	const int size = 512;
+	const int tilesz = 24;
+	std::vector<float> heights(size * size);
+	for (int i = 0; i < size * size; ++i)
+		heights[i] = 100.0f * std::sin(0.01f * float(i % size)) * std::cos(0.013f * float(i / size));
+
+	const pe::HeightField field{ heights.data(), size, size, size, pe::HeightBorder::Clamp };
+	auto sample = [&] (int x, int y) {
+		x = std::max(0, std::min(size - 1, x));
+		y = std::max(0, std::min(size - 1, y));
+		return heights[y * size + x];
+	};
+
+	const int tiles = 1 + size / tilesz;
+	auto build = [&] (const auto& source) {
+		size_t vcount = 0;
+		for (int i = 0; i < tiles; ++i) {
+			for (int j = 0; j < tiles; ++j)
+				vcount += pe::BuildHMap(i * tilesz, j * tilesz, tilesz + 1, tilesz + 1, { -8.0f, -8.0f }, { 8.0f, 8.0f }, source).size();
+		}
+		return vcount;
+	};
+
+	Bench("BuildHMap/function", runs, [&] { return build(std::function<float(int, int)>(sample)); });
+	Bench("BuildHMap/heightfield", runs, [&] { return build(field); });
+}
+
+// 4096 agents following the ground and casting a line of sight each, over a 1024x1024 map
+void BenchHeightQuery(int runs)
+{
+	const int size = 1024;
+	std::vector<float> heights(size * size);
+	for (int i = 0; i < size * size; ++i)
+		heights[i] = 100.0f * std::sin(0.01f * float(i % size)) * std::cos(0.013f * float(i / size));
+
+	const pe::HeightField field{ heights.data(), size, size, size, pe::HeightBorder::Clamp };
+	const pe::HeightQuery query(field, { -358.4f, -358.4f }, { 0.7f, 0.7f });
+
+	const int count = 4096;
+	std::vector<pe::vec2> points(count);
+	for (int i = 0; i < count; ++i)
+		points[i] = { -350.0f + float((i * 7919) % 700), -350.0f + float((i * 104729) % 700) };
+	std::vector<float> out(count);
+	std::vector<pe::vec3> normals(count);
+
+	Bench("HeightQuery/sample", runs, [&] {
+		query.sample(points.data(), count, out.data(), normals.data());
+		return size_t(count);
+	});
+	// line of sight to something 50 m away, then a long pick ray from high up
+	Bench("HeightQuery/visible", runs, [&] {
+		size_t blocked = 0;
+		for (int i = 0; i < count; ++i) {
+			const pe::vec3 eye{ points[i].X, points[i].Y, out[i] + 2.0f };
+			const pe::vec2 at{ points[i].X + 40.0f, points[i].Y + 30.0f };
+			blocked += query.visible(eye, { at.X, at.Y, query.height(at) + 2.0f }) ? 0 : 1;
+		}
+		return blocked;
+	});
+	Bench("HeightQuery/raycast", runs, [&] {
+		size_t hits = 0;
+		for (int i = 0; i < count; ++i)
+			hits += query.raycast({ points[i].X, points[i].Y, 300.0f }, { 0.3f, 0.2f, -1.0f }, 1000.0f) ? 1 : 0;
+		return hits;
+	});
+}
+
+// 100k nodes as a thousand roots with a chain of a hundred below each, moving the roots dirties everything
+void BenchTransformHierarchy(int runs)
+{
+	const int roots = 1000;
+	const int depth = 100;
+	pe::TransformHierarchy scene;
+	scene.reserve(roots * depth);
+	std::vector<int> top(roots);
+	for (int r = 0; r < roots; ++r) {
+		int parent = top[r] = scene.add(pe::TransformHierarchy::None, { float(r % 32), float(r / 32), 0.0f });
+		for (int d = 1; d < depth; ++d)
+			parent = scene.add(parent, { 0.0f, 0.0f, 1.0f }, HMM_QuaternionFromAxisAngle({ 0, 0, 1 }, 0.01f * float(d)), { 0.99f, 0.99f, 0.99f });
+	}
+	scene.update();
+
+	float t = 0.0f;
+	Bench("TransformHierarchy/update", runs, [&] {
+		t += 0.1f;
+		for (int r = 0; r < roots; ++r)
+			scene.setTranslation(top[r], { float(r % 32), float(r / 32), t });
+		scene.update();
+		return size_t(scene.size());
+	});
+	Bench("TransformHierarchy/clean", runs, [&] {
+		scene.update();
+		return size_t(scene.size());
+	});
+}
+
+// 16 bit binary pgm, the format Game::init reads hmap.ppm as
+bool WritePGM(const std::string& path, int size)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		return false;
+	out << "P5\n" << size << " " << size << "\n65535\n";
+	std::vector<uint8_t> row(2 * size);
+	for (int y = 0; y < size; ++y) {
+		for (int x = 0; x < size; ++x) {
+			const float h = 0.5f + 0.25f * std::sin(0.02f * float(x)) + 0.25f * std::cos(0.017f * float(y));
+			const uint16_t v = uint16_t(h * 65535.0f);
+			row[2 * x] = uint8_t(v >> 8);
+			row[2 * x + 1] = uint8_t(v & 0xff);
+		}
+		out.write(reinterpret_cast<const char*>(row.data()), row.size());
+	}
+	return bool(out);
+}
+
+// bc1 with a full mip chain, the payload is noise since only the upload path is measured
+bool WriteDDS(const std::string& path, int size)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		return false;
+
+	int mips = 1;
+	while ((size >> mips) > 0)
+		++mips;
+
+	uint32_t header[31] = {};
+	header[0] = 124;
+	header[1] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;
+	header[2] = size;
+	header[3] = size;
+	header[4] = ((size + 3) / 4) * ((size + 3) / 4) * 8;
+	header[6] = mips;
+	// pixel format: size, DDPF_FOURCC, 'DXT1'
+	header[18] = 32;
+	header[19] = 0x4;
+	header[20] = 0x31545844;
+	header[26] = 0x1000 | 0x400000 | 0x8;
+	out.write("DDS ", 4);
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	uint32_t seed = 1;
+	for (int i = 0; i < mips; ++i) {
+		const int blocks = std::max(1, (size >> i) / 4);
+		std::vector<uint32_t> data(blocks * blocks * 2);
+		for (uint32_t& v : data)
+			v = seed = seed * 1664525 + 1013904223;
+		out.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(uint32_t));
+	}
+	return bool(out);
+}
+
+// ranged script methods starting past the end of an array must not touch the guards around it
+bool CheckScriptRanges(pe::Context& ctx)
+{
+	const int guard = 4;
+	const int count = 10;
+	std::vector<int32_t> ids(count + 2 * guard, -1);
+	std::vector<pe::Transform> transforms(count + 2 * guard, { HMM_Mat4d(1.0f) });
+	pe::BindMeshIds(ctx, "checkIds", ids.data() + guard, count);
+	pe::BindTransforms(ctx, "checkTransforms", transforms.data() + guard, count);
+
+	const char* script = R"(
+		local ids, t = pipo.checkIds, pipo.checkTransforms
+		ids:fill(7, #ids + 5)
+		ids:fill(7, #ids + 2, 3)
+		ids:setValues({ 1, 2, 3 }, #ids + 3)
+		assert(#ids:values({}, #ids + 5) == 0)
+		t:translate(1, 2, 3, 100)
+		t:rotate(90, 0, 0, 1, #t + 2, 4)
+		t:setPositions({ 1, 2, 3 }, #t + 4)
+		assert(#t:positions({}, #t + 5) == 0)
+		ids:fill(5, #ids, 100)
+		assert(ids:get(#ids) == 5)
+	)";
+	if (luaL_dostring(ctx.interp, script) != LUA_OK) {
+		std::cerr << "script ranges: " << lua_tostring(ctx.interp, -1) << "\n";
+		lua_pop(ctx.interp, 1);
+		return false;
+	}
+
+	const pe::Transform identity{ HMM_Mat4d(1.0f) };
+	for (int i = 0; i < int(ids.size()); ++i) {
+		// only the last id is in range, for the final fill
+		if (ids[i] != (i == guard + count - 1 ? 5 : -1)) {
+			std::cerr << "script ranges: id " << i - guard << " changed\n";
+			return false;
+		}
+		if (std::memcmp(&transforms[i], &identity, sizeof(identity)) != 0) {
+			std::cerr << "script ranges: transform " << i - guard << " changed\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// loaders that need a live sokol context, every run releases what it made
+void BenchAssets(pe::Context& ctx, int runs)
+{
+	Bench("LoadMesh", runs, [&] {
+		const std::optional<pe::Mesh> mesh = pe::LoadMesh(ctx, "pipo.ply");
+		if (!mesh)
+			return size_t(0);
+		pe::ReleaseMesh(ctx, *mesh);
+		pe::CollectResources(ctx);
+		return size_t(mesh->pcount);
+	});
+
+	std::vector<float> heights;
+	int size = 0;
+	Bench("LoadPPM", runs, [&] {
+		const std::optional<pe::PPMInfo> ppm = pe::LoadPPM("hmap.ppm", heights, 100.0f, -100.0f, 0, ctx.jobs.get());
+		size = ppm ? ppm->width : 0;
+		return heights.size();
+	});
+
+	Bench("LoadDDS", runs, [&] {
+		const std::optional<pe::Texture> tex = pe::LoadDDS(ctx, { "terrain00.dds" });
+		if (!tex)
+			return size_t(0);
+		pe::ReleaseTexture(ctx, *tex);
+		pe::CollectResources(ctx);
+		return size_t(1);
+	});
+
+	// every tile of the heightmap at the size Game::init uses
+	const int tilesz = 24;
+	const int tiles = 1 + size / tilesz;
+	const pe::HeightField field{ heights.data(), size, size, size, pe::HeightBorder::Clamp };
+	Bench("MakeHMap", runs, [&] {
+		std::vector<pe::Mesh> meshes;
+		for (int i = 0; i < tiles; ++i) {
+			for (int j = 0; j < tiles; ++j)
+				meshes.push_back(pe::MakeHMap(ctx, i * tilesz, j * tilesz, tilesz + 1, tilesz + 1, { -8.0f, -8.0f }, { 8.0f, 8.0f }, field));
+		}
+		for (const pe::Mesh& mesh : meshes)
+			pe::ReleaseMesh(ctx, mesh);
+		pe::CollectResources(ctx);
+		return meshes.size();
+	});
+}
+
+// a fixed number of unpaced frames, only the cpu side of Game::draw is timed
+void BenchFrames(pe::Context& ctx, int frames)
+{
+	Game game;
+	const uint64_t initStart = stm_now();
+	game.init(ctx, {});
+	Report("Game::init", stm_ms(stm_since(initStart)), 1, 0);
+
+	double drawMs = 0.0;
+	double drawBest = 1e30;
+	pe::RunParams params{
+		.update = [&] (pe::Context& ctx, const pe::UpdateParams& p) { return game.update(ctx, p); },
+		.draw = [&] (pe::Context& ctx, const pe::DrawParams& p) {
+			const uint64_t start = stm_now();
+			const bool ok = game.draw(ctx, p);
+			const double ms = stm_ms(stm_since(start));
+			drawMs += ms;
+			drawBest = std::min(drawBest, ms);
+			return ok;
+		},
+		.frameMs = 0,
+		.vsync = false,
+		.frames = uint32_t(frames),
+	};
+
+	const uint64_t loopStart = stm_now();
+	pe::Loop(ctx, params);
+	const double loopMs = stm_ms(stm_since(loopStart));
+
+	Report("Loop/frame", loopMs / frames, frames, frames);
+	Report("Game::draw/mean", drawMs / frames, frames, frames);
+	Report("Game::draw/best", drawBest, frames, frames);
+	game.release(ctx, {});
+}
+
+void WriteJSON(std::ostream& out)
+{
+	out << "{\n\t\"benchmarks\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& r = results[i];
+		out << "\t\t{ \"name\": \"" << r.name << "\", \"ms\": " << r.ms << ", \"runs\": " << r.runs << ", \"items\": " << r.items << " }"
+			<< (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "\t]\n}\n";
+}
+
+}
+
+// bench [ply side] [runs] [frames], json on stdout, progress on stderr
+int main(int argc, char** argv)
+{
+	const int side = argc > 1 ? std::atoi(argv[1]) : 1500;
+	const int runs = argc > 2 ? std::atoi(argv[2]) : 3;
+	const int frames = argc > 3 ? std::atoi(argv[3]) : 600;
+
+	// synthetic assets, Game::init finds them under their usual names
+	namespace fs = std::filesystem;
+	const fs::path cwd = fs::current_path();
+	const fs::path dir = fs::temp_directory_path() / "pipo_bench";
+	fs::create_directories(dir);
+	fs::current_path(dir);
+	if (!WriteGridPLY("pipo.ply", 256, true) || !WritePGM("hmap.ppm", 1024) || !WriteDDS("terrain00.dds", 1024)) {
+		std::cerr << "cannot write bench assets to " << dir << "\n";
+		return 1;
+	}
+
+	stm_setup();
+
+	BenchPLY(side, runs);
+	BenchBuildHMap(runs);
+	BenchHeightQuery(runs);
+	BenchTransformHierarchy(runs);
+
+	pe::Context context;
+	pe::Init(context);
+	if (!CheckScriptRanges(context)) {
+		pe::Release(context);
+		return 1;
+	}
+	BenchAssets(context, runs);
+	BenchFrames(context, frames);
+	pe::Release(context);
+
+	fs::current_path(cwd);
+	fs::remove_all(dir);
+
+	std::cout.precision(4);
+	std::cout << std::fixed;
+	WriteJSON(std::cout);
+
+	return 0;
+}
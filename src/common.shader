@@ -11,3 +11,85 @@ in vec2 vtextcoord;
 in vec4 vcolor;
 @end
 
+@block packed_vertex
+in vec4 vposition;
+in vec2 vnormal;
+in vec2 vtextcoord;
+in vec4 vcolor;
+
+// w holds both exponents, see PackedVertex
+vec3 unpack_position() {
+	return vposition.xyz * exp2(floor(vposition.w / 32.0));
+}
+
+vec3 unpack_normal() {
+	vec3 n = vec3(vnormal, 1.0 - abs(vnormal.x) - abs(vnormal.y));
+	float t = max(-n.z, 0.0);
+	n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+	return normalize(n);
+}
+
+vec2 unpack_textcoord() {
+	return vtextcoord * exp2(mod(vposition.w, 32.0) - 16.0);
+}
+@end
+
+@block vertex_common
+uniform params_default_pass {
+	mat4 view;
+	mat4 proj;
+};
+
+out vec4 pcolor;
+out vec3 pnormal;
+out vec3 pcampos;
+out vec3 pworldpos;
+out vec2 ptextcoord;
+
+// the vertex shaders only differ in how they decode their inputs
+void emit_vertex(mat4 world, vec3 position, vec3 normal, vec4 color, vec2 textcoord) {
+	vec4 worldpos = world * vec4(position, 1);
+	pcampos = (view * vec4(0, 0, 0, 1)).xyz;
+	pcolor = color;
+	pnormal = normalize((vec4(normal, 0) * world).xyz);
+	pworldpos = worldpos.xyz / worldpos.w;
+	ptextcoord = textcoord;
+	gl_Position = proj * view * worldpos;
+}
+@end
+
+@block lighting
+uniform params_default_lighting {
+	vec3 lightdir;
+};
+
+in vec4 pcolor;
+in vec3 pnormal;
+in vec3 pcampos;
+in vec3 pworldpos;
+in vec2 ptextcoord;
+
+out vec4 fragcolor;
+
+vec4 shade(vec4 albedo) {
+	vec3 n = normalize(pnormal);
+	vec3 viewdir = normalize(pworldpos - pcampos);
+	vec3 rdir = reflect(viewdir, n);
+	//vec3 rdir = -normalize(lightdir + viewdir);
+	float depth = length(pworldpos - pcampos);
+	float fog = 1.0f - exp(0.001f * -depth);
+
+	float ndotl = dot(lightdir, n);
+	float ndotr = dot(lightdir, rdir);
+	//float ndotr = max(0, dot(rdir, n));
+	float diff = pow(0.5 * (1 +  ndotl), 2);
+	float spec = pow(ndotr, 32);
+	float fresnel = pow(1 - abs(dot(n, -viewdir)), 16);
+
+	vec4 color = vec4(diff.xxx, 1) * pcolor * albedo;
+	color.xyz = color.xyz + (diff * 0.5f * fresnel).xxx;
+	color.xyz = color.xyz + 0.3f * spec.xxx;
+	color.xyz = mix(color.xyz, vec3(0.3, 0.3, 0.6), fog);
+	return color;
+}
+@end
@@ -0,0 +1,268 @@
+#include "pipoengine.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace pe = pipoengine;
+
+class PackWriter
+{
+public:
+	template <typename T>
+	bool add(std::string_view name, pe::PackEntryType type, const T& header, std::vector<uint8_t> blob)
+	{
+		pe::PackEntry entry;
+		if (name.size() >= entry.name.size()) {
+			std::cerr << "name too long: " << name << "\n";
+			return false;
+		}
+		std::copy(name.begin(), name.end(), entry.name.begin());
+		entry.type = type;
+		memcpy(blob.data(), &header, sizeof(T));
+		_entries.push_back(entry);
+		_blobs.push_back(std::move(blob));
+		return true;
+	}
+
+	bool write(std::string_view path)
+	{
+		pe::PackHeader header;
+		header.count = uint32_t(_entries.size());
+
+		uint64_t offset = align(sizeof(pe::PackHeader) + _entries.size() * sizeof(pe::PackEntry));
+		for (size_t i = 0; i < _entries.size(); ++i) {
+			_entries[i].offset = offset;
+			_entries[i].size = _blobs[i].size();
+			offset = align(offset + _blobs[i].size());
+		}
+
+		std::ofstream out(std::string(path), std::ios::binary);
+		if (!out)
+			return false;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(_entries.data()), _entries.size() * sizeof(pe::PackEntry));
+		for (size_t i = 0; i < _entries.size(); ++i) {
+			pad(out, _entries[i].offset);
+			out.write(reinterpret_cast<const char*>(_blobs[i].data()), _blobs[i].size());
+		}
+		return bool(out);
+	}
+
+	// appends an aligned payload and returns its blob-relative offset
+	static uint32_t append(std::vector<uint8_t>& blob, const void* data, size_t size)
+	{
+		const uint32_t offset = uint32_t(align(blob.size()));
+		blob.resize(offset + size);
+		if (size > 0)
+			memcpy(blob.data() + offset, data, size);
+		return offset;
+	}
+
+	static uint64_t align(uint64_t v)
+	{
+		return (v + pe::PackAlign - 1) & ~uint64_t(pe::PackAlign - 1);
+	}
+
+protected:
+	static void pad(std::ofstream& out, uint64_t offset)
+	{
+		const char zero[pe::PackAlign] = {};
+		while (uint64_t(out.tellp()) < offset)
+			out.write(zero, std::min<uint64_t>(sizeof(zero), offset - out.tellp()));
+	}
+
+	std::vector<pe::PackEntry> _entries;
+	std::vector<std::vector<uint8_t>> _blobs;
+};
+
+// normals are generated when the file has none, tangents only on request
+bool CookMesh(PackWriter& pack, const std::string& path, bool tangents)
+{
+	std::optional<pe::MeshData> data = pe::ParsePLY(path);
+	if (!data)
+		return false;
+	// point clouds parse fine but there is nothing to draw
+	if (data->indice.empty()) {
+		std::cerr << path << ": no faces\n";
+		return false;
+	}
+
+	pe::JobSystem jobs;
+	if (!data->hasNormals)
+		pe::ComputeNormals(*data, &jobs);
+	if (tangents)
+		pe::ComputeTangents(*data, &jobs);
+
+	const pe::MeshOptimizeStats stats = pe::OptimizeMesh(*data);
+	std::cout << path << ": ACMR " << stats.acmrBefore << " -> " << stats.acmrAfter << "\n";
+
+	std::vector<uint8_t> blob(sizeof(pe::PackMesh));
+	pe::PackMesh mesh{};
+	mesh.vertexCount = data->vertice.size();
+	mesh.indexCount = data->indice.size();
+	const std::vector<pe::PackedVertex> packed = pe::PackVertices(data->vertice);
+	mesh.vertexOffset = PackWriter::append(blob, packed.data(), packed.size() * sizeof(pe::PackedVertex));
+	if (*std::max_element(data->indice.begin(), data->indice.end()) > pe::MaxIndex16) {
+		mesh.indexSize = sizeof(uint32_t);
+		mesh.indexOffset = PackWriter::append(blob, data->indice.data(), data->indice.size() * sizeof(uint32_t));
+	} else {
+		const std::vector<uint16_t> narrow(data->indice.begin(), data->indice.end());
+		mesh.indexSize = sizeof(uint16_t);
+		mesh.indexOffset = PackWriter::append(blob, narrow.data(), narrow.size() * sizeof(uint16_t));
+	}
+	if (tangents) {
+		const std::vector<std::array<int16_t, 4>> packedTangents = pe::PackTangents(data->tangents);
+		mesh.tangentOffset = PackWriter::append(blob, packedTangents.data(), packedTangents.size() * sizeof(packedTangents[0]));
+	}
+	mesh.bounds = pe::ComputeBounds(packed);
+	return pack.add(path, pe::PackEntryType::Mesh, mesh, std::move(blob));
+}
+
+// every item becomes one slice, they must share size, mips and format
+bool CookTexture(PackWriter& pack, const std::string& name, const std::vector<std::string>& items)
+{
+	std::vector<tinyddsloader::DDSFile> dds(items.size());
+	for (size_t i = 0; i < items.size(); ++i) {
+		if (dds[i].Load(items[i].c_str()) != tinyddsloader::Result::Success)
+			return false;
+		if (dds[i].GetWidth() != dds[0].GetWidth() || dds[i].GetHeight() != dds[0].GetHeight() || dds[i].GetMipCount() != dds[0].GetMipCount() || dds[i].GetFormat() != dds[0].GetFormat()) {
+			std::cerr << items[i] << ": does not match " << items[0] << "\n";
+			return false;
+		}
+	}
+	if (dds.empty() || dds[0].GetArraySize() != 1)
+		return false;
+
+	std::vector<uint8_t> blob(sizeof(pe::PackTexture));
+	pe::PackTexture tex{};
+	tex.width = dds[0].GetWidth();
+	tex.height = dds[0].GetHeight();
+	tex.mips = std::min<uint32_t>(dds[0].GetMipCount(), SG_MAX_MIPMAPS);
+	tex.pixelFormat = pe::DDSPixelFormat(dds[0].GetFormat());
+	tex.slices = uint32_t(dds.size());
+	if (tex.pixelFormat == SG_PIXELFORMAT_NONE) {
+		std::cerr << items[0] << ": unsupported dxgi format " << uint32_t(dds[0].GetFormat()) << "\n";
+		return false;
+	}
+	for (uint32_t i = 0; i < tex.mips; ++i) {
+		std::vector<uint8_t> mip;
+		for (const tinyddsloader::DDSFile& d : dds) {
+			const tinyddsloader::DDSFile::ImageData* data = d.GetImageData(i);
+			const uint8_t* mem = static_cast<const uint8_t*>(data->m_mem);
+			mip.insert(mip.end(), mem, mem + data->m_memSlicePitch);
+		}
+		tex.mipSize[i] = mip.size();
+		tex.mipOffset[i] = PackWriter::append(blob, mip.data(), mip.size());
+	}
+	return pack.add(name, pe::PackEntryType::Texture, tex, std::move(blob));
+}
+
+// heightmap samples are stored scaled, tiles are laid out like Game::init does
+bool CookHeightMap(PackWriter& pack, const std::string& path, int tilesz, float extent, float scale, float bias)
+{
+	pe::JobSystem jobs;
+	std::vector<float> heights;
+	const std::optional<pe::PPMInfo> ppm = pe::LoadPPM(path, heights, scale, bias, 0, &jobs);
+	if (!ppm)
+		return false;
+	const int width = ppm->width;
+	const int height = ppm->height;
+
+	{
+		std::vector<uint8_t> blob(sizeof(pe::PackHeightMap));
+		pe::PackHeightMap hmap{};
+		hmap.width = width;
+		hmap.height = height;
+		hmap.dataOffset = PackWriter::append(blob, heights.data(), heights.size() * sizeof(float));
+		if (!pack.add(path, pe::PackEntryType::HeightMap, hmap, std::move(blob)))
+			return false;
+	}
+
+	const pe::HeightField field{ heights.data(), width, height, width, pe::HeightBorder::Clamp };
+
+	const float hext = 0.5f * extent;
+	const int tx = 1 + width / tilesz;
+	const int ty = 1 + height / tilesz;
+	std::vector<pe::PackHMapTile> tiles(tx * ty);
+	std::vector<std::vector<pe::TerrainVertex>> vertice(tx * ty);
+
+	jobs.parallelFor(tx * ty, [&] (int k) {
+		pe::PackHMapTile& tile = tiles[k];
+		tile.ox = (k / ty) * tilesz;
+		tile.oy = (k % ty) * tilesz;
+		tile.w = tilesz + 1;
+		tile.h = tilesz + 1;
+		tile.min = { -hext, -hext };
+		tile.max = { hext, hext };
+		const std::vector<pe::BaseVertex> full = pe::BuildHMap(tile.ox, tile.oy, tile.w, tile.h, tile.min, tile.max, field);
+		tile.bounds = pe::ComputeBounds(full);
+		vertice[k] = pe::CompactHMap(full);
+	});
+
+	for (int k = 0; k < tx * ty; ++k) {
+		std::vector<uint8_t> blob(sizeof(pe::PackHMapTile));
+		tiles[k].vertexOffset = PackWriter::append(blob, vertice[k].data(), vertice[k].size() * sizeof(pe::TerrainVertex));
+
+		const std::string name = path + ":" + std::to_string(k / ty) + ":" + std::to_string(k % ty);
+		if (!pack.add(name, pe::PackEntryType::HMapTile, tiles[k], std::move(blob)))
+			return false;
+	}
+
+	return true;
+}
+
+int Usage()
+{
+	std::cerr
+		<< "usage: cook <out.pack> <item>...\n"
+		<< "  mesh <file.ply>\n"
+		<< "  tangentmesh <file.ply>\n"
+		<< "  texture <file.dds>\n"
+		<< "  texarray <name> <count> <file.dds>...\n"
+		<< "  hmap <file.ppm> <tile size> <tile extent> <height scale> <height bias>\n";
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+		return Usage();
+
+	PackWriter pack;
+
+	for (int i = 2; i < argc; ++i) {
+		const std::string_view kind = argv[i];
+		const char* item = i + 1 < argc ? argv[i + 1] : "";
+		bool ok = false;
+		if (kind == "mesh" && i + 1 < argc) {
+			ok = CookMesh(pack, argv[++i], false);
+		} else if (kind == "tangentmesh" && i + 1 < argc) {
+			ok = CookMesh(pack, argv[++i], true);
+		} else if (kind == "texture" && i + 1 < argc) {
+			ok = CookTexture(pack, argv[i + 1], { argv[i + 1] });
+			++i;
+		} else if (kind == "texarray" && i + 2 < argc && std::atoi(argv[i + 2]) > 0 && i + 2 + std::atoi(argv[i + 2]) < argc) {
+			const int count = std::atoi(argv[i + 2]);
+			ok = CookTexture(pack, argv[i + 1], std::vector<std::string>(argv + i + 3, argv + i + 3 + count));
+			i += 2 + count;
+		} else if (kind == "hmap" && i + 5 < argc) {
+			ok = CookHeightMap(pack, argv[i + 1], std::atoi(argv[i + 2]), std::atof(argv[i + 3]), std::atof(argv[i + 4]), std::atof(argv[i + 5]));
+			i += 5;
+		} else {
+			return Usage();
+		}
+		if (!ok) {
+			std::cerr << "cannot cook " << kind << " " << item << "\n";
+			return 1;
+		}
+	}
+
+	if (!pack.write(argv[1])) {
+		std::cerr << "cannot write " << argv[1] << "\n";
+		return 1;
+	}
+
+	return 0;
+}
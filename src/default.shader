@@ -3,74 +3,139 @@
 
 @vs vs_default
 
-uniform params_default_pass {
-	mat4 view;
-	mat4 proj;
+uniform params_default_instance {
+	mat4 world;
 };
 
+@include_block base_vertex
+@include_block vertex_common
+
+void main() {
+	emit_vertex(world, vposition, vnormal, vcolor, vtextcoord);
+}
+
+@end
+
+@vs vs_instanced
+
+@include_block base_vertex
+@include_block vertex_common
+
+in vec4 iworld0;
+in vec4 iworld1;
+in vec4 iworld2;
+in vec4 iworld3;
+
+void main() {
+	emit_vertex(mat4(iworld0, iworld1, iworld2, iworld3), vposition, vnormal, vcolor, vtextcoord);
+}
+
+@end
+
+@vs vs_packed
+
 uniform params_default_instance {
 	mat4 world;
 };
 
-@include_block base_vertex
+@include_block packed_vertex
+@include_block vertex_common
 
-out vec4 pcolor;
-out vec3 pnormal;
-out vec3 pcampos;
-out vec3 pworldpos;
-out vec2 ptextcoord;
+void main() {
+	emit_vertex(world, unpack_position(), unpack_normal(), vcolor, unpack_textcoord());
+}
+
+@end
+
+@vs vs_packed_instanced
+
+@include_block packed_vertex
+@include_block vertex_common
+
+in vec4 iworld0;
+in vec4 iworld1;
+in vec4 iworld2;
+in vec4 iworld3;
 
 void main() {
-	mat4 wvp = proj * view * world;
-	vec4 worldpos = world * vec4(vposition.xyz, 1);
-	pcampos = (view * vec4(0, 0, 0, 1)).xyz;
-	pcolor = vcolor;
-	pnormal = normalize((vec4(vnormal, 0) * world).xyz);
-	pworldpos = worldpos.xyz / worldpos.w;
-	ptextcoord = vtextcoord;
-	gl_Position = wvp * vec4(vposition.xyz, 1);
+	emit_vertex(mat4(iworld0, iworld1, iworld2, iworld3), unpack_position(), unpack_normal(), vcolor, unpack_textcoord());
 }
 
 @end
 
-@fs fs_default
+@vs vs_terrain
 
-uniform params_default_lighting {
-	vec3 lightdir;
+uniform params_default_instance {
+	mat4 world;
 };
 
+// buffer 0 is per tile, buffer 1 is the grid shared by every tile of that size
+in float vheight;
+in vec4 vnormal;
+in vec4 vgrid;
+
+@include_block vertex_common
+
+void main() {
+	emit_vertex(world, vec3(vgrid.xy, vheight), vnormal.xyz, vec4(1, 0, 1, 1), vgrid.zw);
+}
+
+@end
+
+@vs vs_terrain_array
+
+uniform params_default_instance {
+	mat4 world;
+};
+
+// buffer 0 is per tile, buffer 1 is the grid shared by every tile of that size
+in float vheight;
+in vec4 vnormal;
+in vec4 vgrid;
+
+@include_block vertex_common
+
+out float player;
+
+void main() {
+	emit_vertex(world, vec3(vgrid.xy, vheight), vnormal.xyz, vec4(1, 1, 1, 1), vgrid.zw);
+	float layer = round(max(vnormal.w, 0.0) * 127.0);
+	player = floor(layer / 8.0) + mod(layer, 8.0) / 7.0;
+}
+
+@end
+
+@fs fs_default
+
 uniform sampler2D texDiffuse;
 
-in vec4 pcolor;
-in vec3 pnormal;
-in vec3 pcampos;
-in vec3 pworldpos;
-in vec2 ptextcoord;
+@include_block lighting
 
-out vec4 fragcolor;
+void main() {
+	fragcolor = shade(texture(texDiffuse, ptextcoord.xy));
+}
+
+@end
+
+@fs fs_terrain_array
+
+// one layer per material, the vertex layer blends into the next one
+uniform sampler2DArray texLayers;
+
+@include_block lighting
+
+in float player;
 
 void main() {
-	vec3 n = normalize(pnormal);
-	vec3 viewdir = normalize(pworldpos - pcampos);
-	vec3 rdir = reflect(viewdir, n);
-	//vec3 rdir = -normalize(lightdir + viewdir);
-	float depth = length(pworldpos - pcampos);
-	float fog = 1.0f - exp(0.001f * -depth);
-
-	float ndotl = dot(lightdir, n);
-	float ndotr = dot(lightdir, rdir);
-	//float ndotr = max(0, dot(rdir, n));
-	float diff = pow(0.5 * (1 +  ndotl), 2);
-	float spec = pow(ndotr, 32);
-	float fresnel = pow(1 - abs(dot(n, -viewdir)), 16);
-
-	fragcolor = vec4(diff.xxx, 1) * pcolor * texture(texDiffuse, ptextcoord.xy);
-	fragcolor.xyz = fragcolor.xyz + (diff * 0.5f * fresnel).xxx;
-	fragcolor.xyz = fragcolor.xyz + 0.3f * spec.xxx;
-	fragcolor.xyz = mix(fragcolor.xyz, vec3(0.3, 0.3, 0.6), fog);
+	float layer = floor(player);
+	fragcolor = shade(mix(texture(texLayers, vec3(ptextcoord.xy, layer)), texture(texLayers, vec3(ptextcoord.xy, layer + 1)), player - layer));
 }
 
 @end
 
 @program default vs_default fs_default
-
+@program instanced vs_instanced fs_default
+@program terrain vs_terrain fs_default
+@program terrain_array vs_terrain_array fs_terrain_array
+@program packed vs_packed fs_default
+@program packed_instanced vs_packed_instanced fs_default
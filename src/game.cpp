@@ -0,0 +1,285 @@
+#include "game.h"
+
+bool Game::init(pe::Context& ctx, const pe::InitParams& params)
+{
+	// cooked assets are used when present, sources are the fallback
+	// the pack stays mapped for textures that stream in after init
+	_pack = pe::OpenPack("assets.pack");
+	const std::optional<pe::Pack>& pack = _pack;
+
+	std::optional<pe::Mesh> model = pack ? pe::LoadMesh(ctx, *pack, "pipo.ply") : std::nullopt;
+	_model = model ? *model : pe::LoadMesh(ctx, "pipo.ply").value_or(_model);
+
+	const float hmpixsz = 0.7f;
+	const int tilesz = 24;
+	const float gsz = hmpixsz * tilesz;
+
+	auto initHMap = [&] (int w, int h) {
+		_hmap._width = w;
+		_hmap._height = h;
+		_hmap._data.reserve(w * h);
+		float hmw = w * hmpixsz;
+		float hmh = h * hmpixsz;
+		_hmap._aabb = { -0.5f * hmw, -0.5f * hmh, 0.5f * hmw, 0.5f * hmh };
+	};
+
+	const pe::PackEntry* hmapEntry = pack ? pack->find("hmap.ppm", pe::PackEntryType::HeightMap) : nullptr;
+	if (const pe::PackHeightMap* hm = hmapEntry ? pack->get<pe::PackHeightMap>(*hmapEntry) : nullptr; hm) {
+		initHMap(hm->width, hm->height);
+		const float* heights = reinterpret_cast<const float*>(pack->data(*hmapEntry, hm->dataOffset));
+		_hmap._data.assign(heights, heights + hm->width * hm->height);
+	} else if (const std::optional<pe::PPMInfo> ppm = pe::LoadPPM("hmap.ppm", _hmap._data, 100.0f, -100.0f, 0, ctx.jobs.get()); ppm) {
+		initHMap(ppm->width, ppm->height);
+	}
+
+	// ground materials, one array layer each
+	std::optional<pe::Texture> layers = pack ? pe::LoadTextureAsync(ctx, *pack, "terrain.layers") : std::nullopt;
+	if (!layers)
+		layers = pe::LoadTextureAsync(ctx, std::vector<std::string>{ "terrain00.dds" });
+
+	const int tx = 1 + _hmap._width / tilesz;
+	const int ty = 1 + _hmap._height / tilesz;
+	const float hgsz = 0.5f * gsz;
+	const float dbgc = 0.99f;
+	const pe::vec2 tileMin{ -dbgc * hgsz, -dbgc * hgsz };
+	const pe::vec2 tileMax{  dbgc * hgsz,  dbgc * hgsz };
+
+	const pe::HeightField field{ _hmap._data.data(), _hmap._width, _hmap._height, _hmap._width, pe::HeightBorder::Clamp };
+	_hmap._query = pe::HeightQuery(field, { _hmap._aabb.X, _hmap._aabb.Y }, { hmpixsz, hmpixsz });
+	const int tileCount = tx * ty;
+
+	// cooked tiles are copied out of the pack, the others are built from the heightmap
+	auto buildTile = [this, field, ty, tilesz, tileMin, tileMax] (int k) -> std::vector<pe::TerrainVertex> {
+		const size_t count = size_t(tilesz + 1) * size_t(tilesz + 1);
+		const std::string name = "hmap.ppm:" + std::to_string(k / ty) + ":" + std::to_string(k % ty);
+		if (const pe::PackEntry* entry = _pack ? _pack->find(name, pe::PackEntryType::HMapTile) : nullptr; entry) {
+			const pe::PackHMapTile* tile = _pack->get<pe::PackHMapTile>(*entry);
+			if (tile && tile->w == tilesz + 1 && tile->h == tilesz + 1 && _pack->contains(*entry, tile->vertexOffset, count * sizeof(pe::TerrainVertex))) {
+				const pe::TerrainVertex* v = reinterpret_cast<const pe::TerrainVertex*>(_pack->data(*entry, tile->vertexOffset));
+				return { v, v + count };
+			}
+		}
+		return pe::CompactHMap(pe::BuildHMap(
+			(k / ty) * tilesz, (k % ty) * tilesz,
+			tilesz + 1, tilesz + 1,
+			tileMin,
+			tileMax,
+			field
+		));
+	};
+	const int capacity = int(std::ceil(2.0f * _groundRadius / gsz) + 1);
+	_groundPager = std::make_unique<pe::TerrainPager>(ctx, tileCount, tilesz + 1, tileMin, tileMax, std::min(tileCount, capacity * capacity), buildTile);
+	_groundLayers = *layers;
+	_groundSpacing = gsz;
+
+	// world space tile bounds come straight from the samples so tiles need not be resident
+	_groundOffsets.resize(tileCount);
+	_groundBounds.resize(tileCount);
+	ctx.jobs->parallelFor(tileCount, [&] (int k) {
+		const int i = k / ty;
+		const int j = k % ty;
+		_groundOffsets[k] = { _hmap._aabb.X + i * tilesz * hmpixsz + hgsz, _hmap._aabb.Y + j * tilesz * hmpixsz + gsz };
+		pe::Bounds& b = _groundBounds[k];
+		for (int y = j * tilesz; y <= (j + 1) * tilesz; ++y) {
+			for (int x = i * tilesz; x <= (i + 1) * tilesz; ++x) {
+				const float z = field.data[std::min(y, field.height - 1) * field.stride + std::min(x, field.width - 1)];
+				b.min.Z = std::min(b.min.Z, z);
+				b.max.Z = std::max(b.max.Z, z);
+			}
+		}
+		b.min.X = _groundOffsets[k].X + tileMin.X;
+		b.min.Y = _groundOffsets[k].Y + tileMin.Y;
+		b.max.X = _groundOffsets[k].X + tileMax.X;
+		b.max.Y = _groundOffsets[k].Y + tileMax.Y;
+	});
+	_groundTree.build(ty, tx, _groundBounds);
+
+	// tiles are roots, the models hang off one root and stay adjacent in the world array
+	_scene.reserve(tileCount + 1 + int(_models.size()));
+	_groundNodes.resize(tileCount);
+	for (int k = 0; k < tileCount; ++k)
+		_groundNodes[k] = _scene.add(pe::TransformHierarchy::None, { _groundOffsets[k].X, _groundOffsets[k].Y, 0.0f });
+	const int modelRoot = _scene.add();
+	const std::array<pe::vec3, 4> modelOffsets{ { { -1.0f, -1.0f, 0.0f }, { 1.0f, -1.0f, 0.0f }, { -1.0f, 1.0f, 0.0f }, { 1.0f, 1.0f, 0.0f } } };
+	for (size_t m = 0; m < _models.size(); ++m)
+		_models[m] = _scene.add(modelRoot, modelOffsets[m]);
+	_scene.update();
+
+	_groundTiles[0] = tx;
+	_groundTiles[1] = ty;
+	_groundTileSize = tilesz + 1;
+	_groundLod.resize(tx * ty);
+	_groundLevels.resize(tx * ty);
+	ctx.jobs->parallelFor(tx * ty, [&] (int k) {
+		_groundLod[k] = pe::ComputeHMapLod((k / ty) * tilesz, (k % ty) * tilesz, tilesz + 1, tilesz + 1, field);
+	});
+	for (int level = 0; level < _groundLod[0].levels; ++level) {
+		for (int stitch = 0; stitch < 16; ++stitch)
+			pe::HMapIndexBuffer(ctx, tilesz + 1, tilesz + 1, level, stitch);
+	}
+
+	const float wsz = 500.0f;
+	const float wh = -95.0f;
+	const std::array<float, 2> uv{ 0.5f, 0.5f };
+	const std::array<float, 3> n { 0, 0, 1 };
+	const std::vector<pe::BaseVertex> vertice =  {
+		{ { -wsz, -wsz, wh }, n, uv, 0xffff0000 },
+		{ {  wsz, -wsz, wh }, n, uv, 0xffff0000 },
+		{ { -wsz,  wsz, wh }, n, uv, 0xffff0000 },
+		{ {  wsz,  wsz, wh }, n, uv, 0xffff0000 },
+	};
+	const std::vector<uint16_t> indice = {
+		0, 1, 2,
+		1, 3, 2,
+	};
+	_test = pe::MakeMesh(ctx, vertice, indice);
+
+	return true;
+}
+
+float Game::getHeightAt(hmm_vec2 pos) const
+{
+	return _hmap._query.height(pos);
+}
+
+bool Game::draw(pe::Context& ctx, const pe::DrawParams& params)
+{
+	// updates run on a fixed step, the camera is drawn between the last two
+	_camState.consume();
+	const CameraState& cam = _camState.front();
+	pe::vec3 camPos = cam.prev + params.alpha * (cam.pos - cam.prev);
+	camPos.Z = getHeightAt({ camPos.X, camPos.Y }) + 1.0f;
+
+	_scene.update();
+	pe::RenderMain(ctx, [&] (int w, int h) {
+		const hmm_mat4 r0{
+			.Elements = {
+				{ 1, 0, 0, 0 },
+				{ 0, 0, 1, 0 },
+				{ 0, 1, 0, 0 },
+				{ 0, 0, 0, 1 },
+			}
+		};
+		const hmm_mat4 r1 = HMM_Rotate(_camAngles.X, { 0, 0, 1 });
+		const hmm_mat4 r2 = HMM_Rotate(_camAngles.Y, { 1, 0, 0 });
+		const hmm_mat4 t = HMM_Translate(-1.0f * camPos);
+		const pe::mat4 camView = r2 * r0 * r1 * t;
+
+		pe::SetCamera(
+			ctx,
+			HMM_Perspective(90.0f, w / float(h), 0.1f, 2000.0f),
+			camView
+		);
+
+		const float lightTime = 0.0008f * params.elapsed;
+		pe::SetLight(
+			ctx,
+			HMM_NormalizeVec3({ 100.0f * cos(lightTime), 100.0f * sin(lightTime), 30.0f })
+		);
+
+		const int tx = _groundTiles[0];
+		const int ty = _groundTiles[1];
+
+		// tiles within _groundRadius of the camera stay resident, nearest first
+		const int ci = int(std::floor((camPos.X - _groundOffsets[0].X) / _groundSpacing + 0.5f));
+		const int cj = int(std::floor((camPos.Y - _groundOffsets[0].Y) / _groundSpacing + 0.5f));
+		const int reach = int(std::ceil(_groundRadius / _groundSpacing));
+		auto distance = [&] (int k) {
+			return std::hypot(_groundOffsets[k].X - camPos.X, _groundOffsets[k].Y - camPos.Y);
+		};
+		_groundWanted.clear();
+		for (int i = std::max(0, ci - reach); i <= std::min(tx - 1, ci + reach); ++i) {
+			for (int j = std::max(0, cj - reach); j <= std::min(ty - 1, cj + reach); ++j) {
+				if (distance(i * ty + j) <= _groundRadius)
+					_groundWanted.push_back(i * ty + j);
+			}
+		}
+		std::sort(_groundWanted.begin(), _groundWanted.end(), [&] (int a, int b) { return distance(a) < distance(b); });
+		_groundPager->update(_groundWanted);
+
+		_visibleGround.clear();
+		if (ctx.cullEnabled) {
+			_groundTree.cull(ctx.frustum, _visibleGround);
+			ctx.stats.culled += int(_groundBounds.size() - _visibleGround.size());
+		} else {
+			for (int i = 0; i < int(_groundBounds.size()); ++i)
+				_visibleGround.push_back(i);
+		}
+
+		// levels are picked for every tile so neighbours of visible tiles stitch correctly
+		for (size_t k = 0; k < _groundBounds.size(); ++k)
+			_groundLevels[k] = pe::SelectHMapLod(ctx, _groundLod[k], _groundBounds[k], 2.0f);
+		pe::BalanceHMapLods(_groundLevels, ty, tx);
+
+		auto levelAt = [&] (int i, int j) {
+			return i < 0 || j < 0 || i >= tx || j >= ty ? -1 : _groundLevels[i * ty + j];
+		};
+		for (int k : _visibleGround) {
+			const int i = k / ty;
+			const int j = k % ty;
+			const int level = _groundLevels[k];
+			const int stitch = pe::HMapStitch(level, levelAt(i - 1, j), levelAt(i + 1, j), levelAt(i, j - 1), levelAt(i, j + 1));
+
+			const pe::Mesh* resident = _groundPager->find(k);
+			if (!resident)
+				continue;
+			pe::Mesh msh = *resident;
+			pe::SetTerrainLayers(ctx, msh, _groundLayers);
+			std::tie(msh.iid, msh.pcount) = pe::HMapIndexBuffer(ctx, _groundTileSize, _groundTileSize, level, stitch);
+			pe::DrawMesh(ctx, msh, _scene.world(_groundNodes[k]));
+		}
+
+		pe::DrawMeshInstanced(ctx, _model, &_scene.world(_models[0]), int(_models.size()));
+
+		//pe::DrawMesh(ctx, _test, { HMM_Translate({ 0.0f, 0.0f, 2.0f }) });
+	});
+
+	return true;
+}
+
+// the pager waits for its builds, which read the pack and heightmap, and hands its buffers back
+bool Game::release(pe::Context&, const pe::ReleaseParams&)
+{
+	_groundPager.reset();
+	return true;
+}
+
+bool Game::event(pe::Context& ctx, const pe::EventParams& params)
+{
+	const float mSensitivity = 0.2f;
+	const float maxa = 70.0f;
+
+	const SDL_Event& e = params.evt;
+	switch (e.type) {
+	case SDL_MOUSEMOTION:
+		_camAngles.X = _camAngles.X - mSensitivity * e.motion.xrel;
+		_camAngles.Y = std::max(-maxa, std::min(maxa, _camAngles.Y + mSensitivity * e.motion.yrel));
+		break;
+	default:
+		break;
+	}
+
+	return true;
+}
+
+bool Game::update(pe::Context& ctx, const pe::UpdateParams& params)
+{
+	const float speed = 0.01f;
+	const Uint8 *state = SDL_GetKeyboardState(NULL);
+	const pe::vec3 prev = _camPos;
+	if (state[SDL_SCANCODE_RIGHT]) {
+		_camPos.X += speed * params.updateMs;
+	}
+	if (state[SDL_SCANCODE_LEFT]) {
+		_camPos.X -= speed * params.updateMs;
+	}
+	if (state[SDL_SCANCODE_UP]) {
+		_camPos.Y += speed * params.updateMs;
+	}
+	if (state[SDL_SCANCODE_DOWN]) {
+		_camPos.Y -= speed * params.updateMs;
+	}
+	_camState.back() = { prev, _camPos };
+	_camState.publish();
+	return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "pipoengine.h"
+
+namespace pe = pipoengine;
+
+struct HeightMap
+{
+	int _width{};
+	int _height{};
+	std::vector<float> _data;
+	pe::vec4 _aabb{};
+	// over _data, sample (i, j) sits at _aabb.XY + (i, j) * pixel size
+	pe::HeightQuery _query;
+};
+
+// what update hands over to draw, possibly from another thread
+struct CameraState
+{
+	pe::vec3 prev{ 0, 0, 0 };
+	pe::vec3 pos{ 0, 0, 0 };
+};
+
+class Game
+{
+public:
+	bool init(pe::Context& ctx, const pe::InitParams& params);
+	bool draw(pe::Context& ctx, const pe::DrawParams& params);
+	bool event(pe::Context& ctx, const pe::EventParams& params);
+	bool release(pe::Context& ctx, const pe::ReleaseParams& params);
+	bool update(pe::Context& ctx, const pe::UpdateParams& params);
+	float getHeightAt(hmm_vec2 pos) const;
+protected:
+	std::optional<pe::Pack> _pack;
+	HeightMap _hmap;
+	pe::Mesh _test;
+	pe::Mesh _model;
+	// tile k = i * ty + j sits at _groundOffsets[k], only tiles near the camera are resident
+	std::vector<pe::vec2> _groundOffsets;
+	std::unique_ptr<pe::TerrainPager> _groundPager;
+	pe::Texture _groundLayers;
+	float _groundSpacing{ 0.0f };
+	float _groundRadius{ 300.0f };
+	std::vector<int> _groundWanted;
+	std::vector<pe::Bounds> _groundBounds;
+	std::vector<pe::HMapLod> _groundLod;
+	std::vector<int> _groundLevels;
+	int _groundTiles[2]{};
+	int _groundTileSize{ 0 };
+	pe::TileQuadTree _groundTree;
+	std::vector<int> _visibleGround;
+	// draw side, ground tiles and models are placed once in init
+	pe::TransformHierarchy _scene;
+	std::vector<int> _groundNodes;
+	std::array<int, 4> _models{};
+	pe::vec2 _camAngles{ 0, 0 };
+	// owned by update, draw only sees _camState
+	pe::vec3 _camPos{ 0, 0, 0 };
+	pe::TripleBuffer<CameraState> _camState;
+};
@@ -1,5 +1,7 @@
 
+#if !defined(SOKOL_DUMMY_BACKEND)
 #define SOKOL_GLCORE33
+#endif
 #define SOKOL_IMPL
 #define HANDMADE_MATH_IMPLEMENTATION
 #define TINYDDSLOADER_IMPLEMENTATION
@@ -8,8 +10,20 @@
 
 #include "shader_default.inl"
 
-#include <sstream>
-#include <fstream>
+#include <cctype>
+#include <charconv>
+#include <cstring>
+#include <cmath>
+#include <cstdio>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace pipoengine {
 
@@ -17,6 +31,11 @@ void SetCamera(Context& ctx, const mat4& proj, const mat4& view)
 {
 	ctx.proj = proj;
 	ctx.view = view;
+	ctx.frustum = MakeFrustum(proj * view);
+
+	// view is rigid, the eye is -R^T * t
+	for (int i = 0; i < 3; ++i)
+		ctx.eye.Elements[i] = -(view.Elements[i][0] * view.Elements[3][0] + view.Elements[i][1] * view.Elements[3][1] + view.Elements[i][2] * view.Elements[3][2]);
 }
 
 void SetLight(Context& ctx, const vec3& lightdir)
@@ -24,347 +43,4142 @@ void SetLight(Context& ctx, const vec3& lightdir)
 	ctx.lightdir = lightdir;
 }
 
+Bounds ComputeBounds(const std::vector<BaseVertex>& vertice)
+{
+	Bounds b;
+	for (const BaseVertex& v : vertice) {
+		b.min = { std::min(b.min.X, v.pos[0]), std::min(b.min.Y, v.pos[1]), std::min(b.min.Z, v.pos[2]) };
+		b.max = { std::max(b.max.X, v.pos[0]), std::max(b.max.Y, v.pos[1]), std::max(b.max.Z, v.pos[2]) };
+	}
+	return b;
+}
+
+Bounds ComputeBounds(const std::vector<PackedVertex>& vertice)
+{
+	Bounds b;
+	for (const PackedVertex& pv : vertice) {
+		const BaseVertex v = UnpackVertex(pv);
+		b.min = { std::min(b.min.X, v.pos[0]), std::min(b.min.Y, v.pos[1]), std::min(b.min.Z, v.pos[2]) };
+		b.max = { std::max(b.max.X, v.pos[0]), std::max(b.max.Y, v.pos[1]), std::max(b.max.Z, v.pos[2]) };
+	}
+	return b;
+}
+
+namespace {
+
+// w holds both exponents: position in w / 32 (rounded down), uv + 16 in the low 5 bits
+int16_t PackExponents(const int position, const int uv)
+{
+	return int16_t(position * 32 + uv + 16);
+}
+
+int PositionExponent(const PackedVertex& p)
+{
+	return int(std::floor(p.pos[3] / 32.0f));
+}
+
+}
+
+std::vector<PackedVertex> PackVertices(const std::vector<BaseVertex>& vertice)
+{
+	// one power of two scale for the whole mesh, the largest coordinate uses the full 16 bits
+	float extent = 0.0f;
+	float uvExtent = 0.0f;
+	for (const BaseVertex& v : vertice) {
+		for (float c : v.pos)
+			extent = std::max(extent, std::abs(c));
+		uvExtent = std::max({ uvExtent, std::abs(v.uv[0]), std::abs(v.uv[1]) });
+	}
+	int exponent = 0;
+	if (extent > 0.0f)
+		std::frexp(extent / 32767.0f, &exponent);
+	// uv keeps 1/4096 steps unless the mesh tiles past +-8
+	int uvExponent = PackedUVExponentMin;
+	if (uvExtent > 0.0f)
+		std::frexp(uvExtent / 32767.0f, &uvExponent);
+	uvExponent = std::clamp(uvExponent, PackedUVExponentMin, PackedUVExponentMax);
+
+	auto quantize = [] (float v, float scale) {
+		return int16_t(std::clamp(std::lround(v * scale), -32767l, 32767l));
+	};
+	auto sign = [] (float v) {
+		return v >= 0.0f ? 1.0f : -1.0f;
+	};
+
+	std::vector<PackedVertex> packed(vertice.size());
+	for (size_t i = 0; i < vertice.size(); ++i) {
+		const BaseVertex& v = vertice[i];
+		PackedVertex& p = packed[i];
+
+		const float scale = std::ldexp(1.0f, -exponent);
+		p.pos = { quantize(v.pos[0], scale), quantize(v.pos[1], scale), quantize(v.pos[2], scale), PackExponents(exponent, uvExponent) };
+
+		// octahedral: project on |x| + |y| + |z| = 1 and fold the lower half over the diagonals
+		const float l1 = std::abs(v.normal[0]) + std::abs(v.normal[1]) + std::abs(v.normal[2]);
+		float ox = l1 > 0.0f ? v.normal[0] / l1 : 0.0f;
+		float oy = l1 > 0.0f ? v.normal[1] / l1 : 0.0f;
+		if (v.normal[2] < 0.0f) {
+			const float fx = (1.0f - std::abs(oy)) * sign(ox);
+			const float fy = (1.0f - std::abs(ox)) * sign(oy);
+			ox = fx;
+			oy = fy;
+		}
+		p.normal = { quantize(ox, 32767.0f), quantize(oy, 32767.0f) };
+
+		const float uvScale = std::ldexp(1.0f, -uvExponent);
+		p.uv = { quantize(v.uv[0], uvScale), quantize(v.uv[1], uvScale) };
+		p.color = v.color;
+	}
+	return packed;
+}
+
+std::vector<std::array<int16_t, 4>> PackTangents(const std::vector<std::array<float, 4>>& tangents)
+{
+	std::vector<std::array<int16_t, 4>> packed(tangents.size());
+	for (size_t i = 0; i < tangents.size(); ++i) {
+		for (int k = 0; k < 4; ++k)
+			packed[i][k] = int16_t(std::clamp(std::lround(tangents[i][k] * 32767.0f), -32767l, 32767l));
+	}
+	return packed;
+}
+
+BaseVertex UnpackVertex(const PackedVertex& p)
+{
+	const int exponent = PositionExponent(p);
+	const float scale = std::ldexp(1.0f, exponent);
+	const float uvScale = std::ldexp(1.0f, p.pos[3] - exponent * 32 - 16);
+
+	vec3 n{ std::max(p.normal[0] / 32767.0f, -1.0f), std::max(p.normal[1] / 32767.0f, -1.0f), 0.0f };
+	n.Z = 1.0f - std::abs(n.X) - std::abs(n.Y);
+	const float t = std::max(-n.Z, 0.0f);
+	n.X += n.X >= 0.0f ? -t : t;
+	n.Y += n.Y >= 0.0f ? -t : t;
+	n = HMM_Normalize(n);
+
+	return {
+		{ p.pos[0] * scale, p.pos[1] * scale, p.pos[2] * scale },
+		{ n.X, n.Y, n.Z },
+		{ p.uv[0] * uvScale, p.uv[1] * uvScale },
+		p.color,
+	};
+}
+
+Bounds TransformBounds(const Bounds& b, const mat4& m)
+{
+	if (!b.valid())
+		return b;
+
+	// Arvo: each output axis takes the min/max contribution of every input axis
+	Bounds r;
+	for (int i = 0; i < 3; ++i) {
+		float lo = m.Elements[3][i];
+		float hi = m.Elements[3][i];
+		for (int j = 0; j < 3; ++j) {
+			const float a = m.Elements[j][i] * b.min.Elements[j];
+			const float c = m.Elements[j][i] * b.max.Elements[j];
+			lo += std::min(a, c);
+			hi += std::max(a, c);
+		}
+		r.min.Elements[i] = lo;
+		r.max.Elements[i] = hi;
+	}
+	return r;
+}
+
+Bounds MergeBounds(const Bounds& a, const Bounds& b)
+{
+	return {
+		{ std::min(a.min.X, b.min.X), std::min(a.min.Y, b.min.Y), std::min(a.min.Z, b.min.Z) },
+		{ std::max(a.max.X, b.max.X), std::max(a.max.Y, b.max.Y), std::max(a.max.Z, b.max.Z) },
+	};
+}
+
+Frustum MakeFrustum(const mat4& viewProj)
+{
+	// Gribb/Hartmann, planes are row3 +/- row0..2 of the clip matrix, normals point inside
+	auto row = [&] (int r) { return HMM_Vec4(viewProj.Elements[0][r], viewProj.Elements[1][r], viewProj.Elements[2][r], viewProj.Elements[3][r]); };
+	const vec4 r0 = row(0);
+	const vec4 r1 = row(1);
+	const vec4 r2 = row(2);
+	const vec4 r3 = row(3);
+	const std::array<vec4, 6> planes = {
+		r3 + r0, r3 + r0 * -1.0f,
+		r3 + r1, r3 + r1 * -1.0f,
+		r3 + r2, r3 + r2 * -1.0f,
+	};
+
+	Frustum f;
+	for (int i = 0; i < 8; ++i) {
+		// the last two lanes repeat the near and far planes
+		const vec4& p = planes[std::min(i, 5)];
+		f.nx[i] = p.X;
+		f.ny[i] = p.Y;
+		f.nz[i] = p.Z;
+		f.d[i] = p.W;
+	}
+	return f;
+}
+
+Visibility TestBounds(const Frustum& f, const Bounds& b)
+{
+	if (!b.valid())
+		return Visibility::Intersect;
+
+	const float cx = 0.5f * (b.max.X + b.min.X);
+	const float cy = 0.5f * (b.max.Y + b.min.Y);
+	const float cz = 0.5f * (b.max.Z + b.min.Z);
+	const float ex = 0.5f * (b.max.X - b.min.X);
+	const float ey = 0.5f * (b.max.Y - b.min.Y);
+	const float ez = 0.5f * (b.max.Z - b.min.Z);
+
+	// signed distance of the center against the projected radius of the box, four planes at a time
+#if defined(__SSE2__)
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 vcx = _mm_set1_ps(cx), vcy = _mm_set1_ps(cy), vcz = _mm_set1_ps(cz);
+	const __m128 vex = _mm_set1_ps(ex), vey = _mm_set1_ps(ey), vez = _mm_set1_ps(ez);
+	int outside = 0;
+	int inside = 0xff;
+	for (int i = 0; i < 8; i += 4) {
+		const __m128 nx = _mm_load_ps(f.nx + i);
+		const __m128 ny = _mm_load_ps(f.ny + i);
+		const __m128 nz = _mm_load_ps(f.nz + i);
+		const __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, vcx), _mm_mul_ps(ny, vcy)), _mm_add_ps(_mm_mul_ps(nz, vcz), _mm_load_ps(f.d + i)));
+		const __m128 rad = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign, nx), vex), _mm_mul_ps(_mm_andnot_ps(sign, ny), vey)), _mm_mul_ps(_mm_andnot_ps(sign, nz), vez));
+		outside |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(dist, rad), _mm_setzero_ps()));
+		inside &= _mm_movemask_ps(_mm_cmpge_ps(_mm_sub_ps(dist, rad), _mm_setzero_ps()));
+	}
+	if (outside)
+		return Visibility::Outside;
+	return inside == 0xf ? Visibility::Inside : Visibility::Intersect;
+#else
+	bool inside = true;
+	for (int i = 0; i < 6; ++i) {
+		const float dist = f.nx[i] * cx + f.ny[i] * cy + f.nz[i] * cz + f.d[i];
+		const float rad = std::abs(f.nx[i]) * ex + std::abs(f.ny[i]) * ey + std::abs(f.nz[i]) * ez;
+		if (dist + rad < 0.0f)
+			return Visibility::Outside;
+		inside &= dist - rad >= 0.0f;
+	}
+	return inside ? Visibility::Inside : Visibility::Intersect;
+#endif
+}
+
+void TileQuadTree::build(int w, int h, const std::vector<Bounds>& tiles)
+{
+	_nodes.clear();
+	_width = w;
+	if (w <= 0 || h <= 0 || tiles.size() < size_t(w * h))
+		return;
+
+	auto make = [&] (auto& self, int x0, int y0, int x1, int y1) -> int {
+		const int index = int(_nodes.size());
+		_nodes.push_back({ {}, x0, y0, x1, y1, { -1, -1, -1, -1 } });
+		if (x1 - x0 == 1 && y1 - y0 == 1) {
+			_nodes[index].bounds = tiles[y0 * w + x0];
+			return index;
+		}
+		const int mx = x1 - x0 > 1 ? (x0 + x1) / 2 : x1;
+		const int my = y1 - y0 > 1 ? (y0 + y1) / 2 : y1;
+		const std::array<std::array<int, 4>, 4> quads = { {
+			{ x0, y0, mx, my }, { mx, y0, x1, my },
+			{ x0, my, mx, y1 }, { mx, my, x1, y1 },
+		} };
+		Bounds b;
+		for (int q = 0; q < 4; ++q) {
+			const auto& r = quads[q];
+			if (r[0] >= r[2] || r[1] >= r[3])
+				continue;
+			const int child = self(self, r[0], r[1], r[2], r[3]);
+			_nodes[index].children[q] = child;
+			b = MergeBounds(b, _nodes[child].bounds);
+		}
+		_nodes[index].bounds = b;
+		return index;
+	};
+	make(make, 0, 0, w, h);
+}
+
+void TileQuadTree::cull(const Frustum& f, std::vector<int>& visible) const
+{
+	if (_nodes.empty())
+		return;
+
+	auto addAll = [&] (const Node& n) {
+		for (int y = n.y0; y < n.y1; ++y) {
+			for (int x = n.x0; x < n.x1; ++x)
+				visible.push_back(y * _width + x);
+		}
+	};
+
+	std::array<int, 128> stack;
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const Node& n = _nodes[stack[--top]];
+		const Visibility v = TestBounds(f, n.bounds);
+		if (v == Visibility::Outside)
+			continue;
+		if (v == Visibility::Inside || n.children[0] < 0) {
+			addAll(n);
+			continue;
+		}
+		for (int child : n.children) {
+			if (child >= 0)
+				stack[top++] = child;
+		}
+	}
+}
+
+namespace {
+
+sg_usage ResolveUsage(sg_usage usage)
+{
+	return usage == _SG_USAGE_DEFAULT ? SG_USAGE_IMMUTABLE : usage;
+}
+
+void Retire(ResourceRegistry& reg, uint32_t id, bool image)
+{
+	reg.retired.push_back({ id, image, reg.frame });
+}
+
+}
+
+sg_buffer MakeBuffer(Context& ctx, const sg_buffer_desc& desc)
+{
+	ResourceRegistry& reg = ctx.resources;
+	ResourceRegistry::Entry entry;
+	entry.kind = desc.type == SG_BUFFERTYPE_INDEXBUFFER ? ResourceKind::Index : ResourceKind::Vertex;
+	entry.usage = ResolveUsage(desc.usage);
+	entry.bytes = desc.size > 0 ? desc.size : desc.data.size;
+	entry.refs = 1;
+
+	// only buffers without initial data can be handed out again
+	sg_buffer buffer{};
+	if (entry.usage != SG_USAGE_IMMUTABLE && desc.data.ptr == nullptr) {
+		auto it = reg.pool.find({ entry.kind, entry.usage, entry.bytes });
+		if (it != reg.pool.end() && !it->second.empty()) {
+			buffer = it->second.back();
+			it->second.pop_back();
+			reg.pooledBytes -= entry.bytes;
+		}
+	}
+	if (buffer.id == 0)
+		buffer = sg_make_buffer(desc);
+
+	reg.buffers[buffer.id] = entry;
+	reg.bytes[size_t(entry.kind)] += entry.bytes;
+	return buffer;
+}
+
+sg_image MakeImage(Context& ctx, const sg_image_desc& desc)
+{
+	ResourceRegistry::Entry entry;
+	entry.kind = ResourceKind::Texture;
+	entry.refs = 1;
+	for (int i = 0; i < SG_MAX_MIPMAPS; ++i)
+		entry.bytes += desc.data.subimage[0][i].size;
+
+	const sg_image image = sg_make_image(desc);
+	ctx.resources.images[image.id] = entry;
+	ctx.resources.bytes[size_t(entry.kind)] += entry.bytes;
+	return image;
+}
+
+void RetainBuffer(Context& ctx, sg_buffer buffer)
+{
+	auto it = ctx.resources.buffers.find(buffer.id);
+	if (it != ctx.resources.buffers.end())
+		++it->second.refs;
+}
+
+void ReleaseBuffer(Context& ctx, sg_buffer buffer)
+{
+	auto it = ctx.resources.buffers.find(buffer.id);
+	if (it != ctx.resources.buffers.end() && --it->second.refs == 0)
+		Retire(ctx.resources, buffer.id, false);
+}
+
+void RetainImage(Context& ctx, sg_image image)
+{
+	auto it = ctx.resources.images.find(image.id);
+	if (it != ctx.resources.images.end())
+		++it->second.refs;
+}
+
+void ReleaseImage(Context& ctx, sg_image image)
+{
+	auto it = ctx.resources.images.find(image.id);
+	if (it != ctx.resources.images.end() && --it->second.refs == 0)
+		Retire(ctx.resources, image.id, true);
+}
+
+void RetainMesh(Context& ctx, const Mesh& mesh)
+{
+	RetainBuffer(ctx, mesh.vid);
+	RetainBuffer(ctx, mesh.iid);
+	RetainBuffer(ctx, mesh.grid);
+}
+
+void ReleaseMesh(Context& ctx, const Mesh& mesh)
+{
+	ReleaseBuffer(ctx, mesh.vid);
+	ReleaseBuffer(ctx, mesh.iid);
+	ReleaseBuffer(ctx, mesh.grid);
+}
+
+void RetainTexture(Context& ctx, const Texture& tex)
+{
+	RetainImage(ctx, tex.iid);
+}
+
+void ReleaseTexture(Context& ctx, const Texture& tex)
+{
+	ReleaseImage(ctx, tex.iid);
+}
+
+void CollectResources(Context& ctx)
+{
+	PIPO_ZONE("CollectResources");
+	ResourceRegistry& reg = ctx.resources;
+	++reg.frame;
+
+	auto keep = std::remove_if(reg.retired.begin(), reg.retired.end(), [&] (const ResourceRegistry::Retired& r) {
+		if (reg.frame - r.frame < uint64_t(reg.framesInFlight))
+			return false;
+
+		auto& entries = r.image ? reg.images : reg.buffers;
+		auto it = entries.find(r.id);
+		// retained again after the release
+		if (it == entries.end() || it->second.refs > 0)
+			return true;
+
+		const ResourceRegistry::Entry entry = it->second;
+		entries.erase(it);
+		reg.bytes[size_t(entry.kind)] -= entry.bytes;
+		if (r.image) {
+			sg_destroy_image({ r.id });
+		} else if (entry.usage != SG_USAGE_IMMUTABLE && reg.pooledBytes + entry.bytes <= reg.poolBudget) {
+			reg.pool[{ entry.kind, entry.usage, entry.bytes }].push_back({ r.id });
+			reg.pooledBytes += entry.bytes;
+		} else {
+			sg_destroy_buffer({ r.id });
+		}
+		return true;
+	});
+	reg.retired.erase(keep, reg.retired.end());
+}
+
+size_t ResourceBytes(const Context& ctx, ResourceKind kind)
+{
+	return ctx.resources.bytes[size_t(kind)];
+}
+
+namespace {
+
+// 16-bit whenever every index fits, 32-bit otherwise
+sg_buffer MakeIndexBuffer(Context& ctx, const std::vector<uint32_t>& indice, bool& wide)
+{
+	wide = !indice.empty() && *std::max_element(indice.begin(), indice.end()) > MaxIndex16;
+	if (wide) {
+		return MakeBuffer(ctx, {
+			.type = SG_BUFFERTYPE_INDEXBUFFER,
+			.data = { &indice[0], indice.size() * sizeof(uint32_t) },
+		});
+	}
+	const std::vector<uint16_t> narrow(indice.begin(), indice.end());
+	return MakeBuffer(ctx, {
+		.type = SG_BUFFERTYPE_INDEXBUFFER,
+		.data = { &narrow[0], narrow.size() * sizeof(uint16_t) },
+	});
+}
+
+}
+
 Mesh MakeMesh(
 	Context& context,
-	const std::variant<sg_buffer, std::vector<BaseVertex>>& vertice,
-	const std::variant<std::pair<sg_buffer, int>, std::vector<uint16_t>>& indice)
+	const std::variant<sg_buffer, std::vector<BaseVertex>, std::vector<PackedVertex>>& vertice,
+	const std::variant<std::pair<sg_buffer, int>, std::vector<uint16_t>, std::vector<uint32_t>>& indice)
 {
 	std::optional<sg_buffer> vid, iid;
 	int sz;
+	Bounds bounds;
+	Pipeline* pip = &context.plDefault;
+	bool wide = false;
 
 	if (const sg_buffer* pvid = std::get_if<sg_buffer>(&vertice); pvid) {
 		vid = *pvid;
+		RetainBuffer(context, *vid);
 	} else if (const std::vector<BaseVertex>* vdata = std::get_if<std::vector<BaseVertex>>(&vertice); vdata) {
-		vid = sg_make_buffer({
+		vid = MakeBuffer(context, {
 			//.size = int(vdata->size() * sizeof(BaseVertex)),
 			.type = SG_BUFFERTYPE_VERTEXBUFFER,
 			.data = { &((*vdata)[0]), vdata->size() * sizeof(BaseVertex) },
 		});
+		bounds = ComputeBounds(*vdata);
+	} else if (const std::vector<PackedVertex>* pdata = std::get_if<std::vector<PackedVertex>>(&vertice); pdata) {
+		vid = MakeBuffer(context, {
+			.type = SG_BUFFERTYPE_VERTEXBUFFER,
+			.data = { &((*pdata)[0]), pdata->size() * sizeof(PackedVertex) },
+		});
+		bounds = ComputeBounds(*pdata);
+		pip = &context.plPacked;
+	}
+
+	// prebuilt buffers are taken as 16-bit, owners of 32-bit ones switch to pip->wide
+	if (const std::pair<sg_buffer, int>* piid = std::get_if<std::pair<sg_buffer, int>>(&indice); piid) {
+		iid = piid->first;
+		sz = piid->second;
+		RetainBuffer(context, *iid);
+	} else if (const std::vector<uint16_t>* idata = std::get_if<std::vector<uint16_t>>(&indice); idata) {
+		iid = MakeBuffer(context, {
+			//.size = int(idata->size() * sizeof(uint16_t)),
+			.type = SG_BUFFERTYPE_INDEXBUFFER,
+			.data = { &((*idata)[0]), idata->size() * sizeof(uint16_t) },
+		});
+		sz = idata->size();
+	} else if (const std::vector<uint32_t>* wdata = std::get_if<std::vector<uint32_t>>(&indice); wdata) {
+		iid = MakeIndexBuffer(context, *wdata, wide);
+		sz = wdata->size();
+	}
+
+	if (wide)
+		pip = pip->wide;
+
+	return { pip, context.txWhite, *vid, *iid, sz, bounds };
+}
+
+std::vector<MeshData> SplitMesh(const MeshData& mesh, const size_t maxVertices)
+{
+	if (mesh.vertice.size() <= maxVertices || maxVertices < 3)
+		return { mesh };
+
+	// triangles are taken in order, a part is closed when the next one would bring too many new vertices
+	std::vector<MeshData> parts;
+	std::vector<uint32_t> remap(mesh.vertice.size(), ~0u);
+	std::vector<uint32_t> used;
+	MeshData part;
+	part.hasNormals = mesh.hasNormals;
+	for (size_t t = 0; t + 2 < mesh.indice.size(); t += 3) {
+		const uint32_t* tri = &mesh.indice[t];
+		const size_t fresh = std::count_if(tri, tri + 3, [&] (uint32_t i) { return remap[i] == ~0u; });
+		if (part.vertice.size() + fresh > maxVertices) {
+			parts.push_back(std::move(part));
+			part = {};
+			part.hasNormals = mesh.hasNormals;
+			for (uint32_t i : used)
+				remap[i] = ~0u;
+			used.clear();
+		}
+		for (int k = 0; k < 3; ++k) {
+			uint32_t& r = remap[tri[k]];
+			if (r == ~0u) {
+				r = uint32_t(part.vertice.size());
+				part.vertice.push_back(mesh.vertice[tri[k]]);
+				if (!mesh.tangents.empty())
+					part.tangents.push_back(mesh.tangents[tri[k]]);
+				used.push_back(tri[k]);
+			}
+			part.indice.push_back(r);
+		}
+	}
+	if (!part.indice.empty())
+		parts.push_back(std::move(part));
+	return parts;
+}
+
+float ComputeACMR(const std::vector<uint32_t>& indice, const size_t vertexCount, const int cacheSize)
+{
+	if (indice.size() < 3)
+		return 0.0f;
+
+	// a vertex is cached while fewer than cacheSize misses happened since it was loaded
+	std::vector<uint32_t> loaded(vertexCount, 0);
+	uint32_t misses = 0;
+	for (uint32_t i : indice) {
+		if (loaded[i] == 0 || misses + 1 - loaded[i] > uint32_t(cacheSize))
+			loaded[i] = ++misses;
+	}
+	return float(misses) / float(indice.size() / 3);
+}
+
+namespace {
+
+constexpr int ForsythCacheSize = 32;
+
+float ForsythScore(int cachePos, int remaining)
+{
+	if (remaining == 0)
+		return -1.0f;
+
+	float score = 0.0f;
+	if (cachePos >= 0) {
+		// the last triangle's vertices are penalised a bit, so strips do not get stuck
+		if (cachePos < 3)
+			score = 0.75f;
+		else
+			score = std::pow(1.0f - float(cachePos - 3) / float(ForsythCacheSize - 3), 1.5f);
+	}
+	return score + 2.0f / std::sqrt(float(remaining));
+}
+
+}
+
+// Forsyth, "Linear-speed vertex cache optimisation"
+void OptimizeVertexCache(std::vector<uint32_t>& indice, const size_t vertexCount)
+{
+	const size_t triCount = indice.size() / 3;
+	if (triCount == 0)
+		return;
+
+	// triangles of each vertex, the first remaining[v] entries are not emitted yet
+	std::vector<uint32_t> offsets(vertexCount + 1, 0);
+	for (size_t i = 0; i < triCount * 3; ++i)
+		++offsets[indice[i] + 1];
+	for (size_t v = 0; v < vertexCount; ++v)
+		offsets[v + 1] += offsets[v];
+	std::vector<uint32_t> adjacency(triCount * 3);
+	std::vector<int> remaining(vertexCount, 0);
+	for (size_t t = 0; t < triCount; ++t) {
+		for (int k = 0; k < 3; ++k) {
+			const uint32_t v = indice[t * 3 + k];
+			adjacency[offsets[v] + remaining[v]++] = uint32_t(t);
+		}
+	}
+
+	std::vector<int> cachePos(vertexCount, -1);
+	std::vector<float> vscore(vertexCount);
+	for (size_t v = 0; v < vertexCount; ++v)
+		vscore[v] = ForsythScore(-1, remaining[v]);
+	std::vector<float> tscore(triCount, 0.0f);
+	for (size_t t = 0; t < triCount; ++t) {
+		for (int k = 0; k < 3; ++k)
+			tscore[t] += vscore[indice[t * 3 + k]];
+	}
+
+	std::vector<bool> emitted(triCount, false);
+	std::vector<uint32_t> out;
+	out.reserve(triCount * 3);
+
+	std::array<uint32_t, ForsythCacheSize + 3> cache;
+	std::array<uint32_t, ForsythCacheSize + 3> next;
+	int cacheCount = 0;
+	size_t cursor = 0;
+	int64_t best = -1;
+
+	while (out.size() < triCount * 3) {
+		if (best < 0) {
+			// nothing left around the cache, continue with the next triangle in input order
+			while (emitted[cursor])
+				++cursor;
+			best = int64_t(cursor);
+		}
+
+		emitted[best] = true;
+		const uint32_t* tri = &indice[best * 3];
+		out.insert(out.end(), tri, tri + 3);
+
+		int n = 0;
+		for (int k = 0; k < 3; ++k) {
+			const uint32_t v = tri[k];
+			if (std::find(next.begin(), next.begin() + n, v) == next.begin() + n)
+				next[n++] = v;
+
+			uint32_t* list = &adjacency[offsets[v]];
+			uint32_t* last = list + remaining[v] - 1;
+			std::iter_swap(std::find(list, last, uint32_t(best)), last);
+			--remaining[v];
+		}
+		for (int i = 0; i < cacheCount; ++i) {
+			if (cache[i] != tri[0] && cache[i] != tri[1] && cache[i] != tri[2])
+				next[n++] = cache[i];
+		}
+
+		// rescore the cache and whatever fell out of it, triangle scores follow by delta
+		for (int i = 0; i < n; ++i) {
+			const uint32_t v = next[i];
+			cachePos[v] = i < ForsythCacheSize ? i : -1;
+			const float score = ForsythScore(cachePos[v], remaining[v]);
+			const float delta = score - vscore[v];
+			vscore[v] = score;
+			for (int j = 0; j < remaining[v]; ++j)
+				tscore[adjacency[offsets[v] + j]] += delta;
+		}
+		cacheCount = std::min(n, ForsythCacheSize);
+		cache = next;
+
+		best = -1;
+		float bestScore = -1.0f;
+		for (int i = 0; i < cacheCount; ++i) {
+			const uint32_t v = cache[i];
+			for (int j = 0; j < remaining[v]; ++j) {
+				const uint32_t t = adjacency[offsets[v] + j];
+				if (tscore[t] > bestScore) {
+					bestScore = tscore[t];
+					best = t;
+				}
+			}
+		}
+	}
+
+	indice.swap(out);
+}
+
+// Sander et al., "Fast triangle reordering for vertex locality and reduced overdraw"
+void OptimizeOverdraw(std::vector<uint32_t>& indice, const std::vector<BaseVertex>& vertice, const float threshold)
+{
+	const size_t triCount = indice.size() / 3;
+	if (triCount < 2)
+		return;
+
+	const float acmr = ComputeACMR(indice, vertice.size());
+
+	// clusters start where the cache is cold anyway, so moving them around costs little
+	std::vector<std::pair<size_t, size_t>> clusters;
+	{
+		std::vector<uint32_t> loaded(vertice.size(), 0);
+		uint32_t misses = 0;
+		size_t start = 0;
+		for (size_t t = 0; t < triCount; ++t) {
+			int triMisses = 0;
+			for (int k = 0; k < 3; ++k) {
+				const uint32_t i = indice[t * 3 + k];
+				if (loaded[i] == 0 || misses + 1 - loaded[i] > 16) {
+					loaded[i] = ++misses;
+					++triMisses;
+				}
+			}
+			if (triMisses == 3 && t > start) {
+				clusters.push_back({ start, t });
+				start = t;
+			}
+		}
+		clusters.push_back({ start, triCount });
+	}
+	if (clusters.size() < 2)
+		return;
+
+	auto pos = [&] (uint32_t i) {
+		const BaseVertex& v = vertice[i];
+		return HMM_Vec3(v.pos[0], v.pos[1], v.pos[2]);
+	};
+
+	vec3 center{ 0.0f, 0.0f, 0.0f };
+	for (const BaseVertex& v : vertice)
+		center = center + HMM_Vec3(v.pos[0], v.pos[1], v.pos[2]);
+	center = center / float(vertice.size());
+
+	// clusters facing away from the mesh center are likely occluders, they go first
+	std::vector<std::pair<float, size_t>> order(clusters.size());
+	for (size_t c = 0; c < clusters.size(); ++c) {
+		vec3 centroid{ 0.0f, 0.0f, 0.0f };
+		vec3 normal{ 0.0f, 0.0f, 0.0f };
+		float area = 0.0f;
+		for (size_t t = clusters[c].first; t < clusters[c].second; ++t) {
+			const vec3 p0 = pos(indice[t * 3 + 0]);
+			const vec3 p1 = pos(indice[t * 3 + 1]);
+			const vec3 p2 = pos(indice[t * 3 + 2]);
+			const vec3 n = HMM_Cross(p1 - p0, p2 - p0);
+			const float a = HMM_Length(n);
+			centroid = centroid + (p0 + p1 + p2) * (a / 3.0f);
+			normal = normal + n;
+			area += a;
+		}
+		const float nl = HMM_Length(normal);
+		float key = 0.0f;
+		if (area > 0.0f && nl > 0.0f)
+			key = HMM_Dot(centroid / area - center, normal / nl);
+		order[c] = { -key, c };
+	}
+	std::stable_sort(order.begin(), order.end(), [] (const auto& a, const auto& b) { return a.first < b.first; });
+
+	std::vector<uint32_t> sorted;
+	sorted.reserve(indice.size());
+	for (const auto& o : order) {
+		const auto& c = clusters[o.second];
+		sorted.insert(sorted.end(), indice.begin() + c.first * 3, indice.begin() + c.second * 3);
+	}
+
+	if (ComputeACMR(sorted, vertice.size()) <= acmr * threshold)
+		indice.swap(sorted);
+}
+
+void OptimizeVertexFetch(MeshData& mesh)
+{
+	// vertices in first use order, unused ones are dropped
+	std::vector<uint32_t> remap(mesh.vertice.size(), ~0u);
+	std::vector<BaseVertex> vertice;
+	std::vector<std::array<float, 4>> tangents;
+	const bool hasTangents = !mesh.tangents.empty();
+	vertice.reserve(mesh.vertice.size());
+	tangents.reserve(mesh.tangents.size());
+	for (uint32_t& i : mesh.indice) {
+		if (remap[i] == ~0u) {
+			remap[i] = uint32_t(vertice.size());
+			vertice.push_back(mesh.vertice[i]);
+			if (hasTangents)
+				tangents.push_back(mesh.tangents[i]);
+		}
+		i = remap[i];
+	}
+	mesh.vertice.swap(vertice);
+	mesh.tangents.swap(tangents);
+}
+
+MeshOptimizeStats OptimizeMesh(MeshData& mesh)
+{
+	MeshOptimizeStats stats;
+	stats.acmrBefore = ComputeACMR(mesh.indice, mesh.vertice.size());
+	OptimizeVertexCache(mesh.indice, mesh.vertice.size());
+	OptimizeOverdraw(mesh.indice, mesh.vertice);
+	OptimizeVertexFetch(mesh);
+	stats.acmrAfter = ComputeACMR(mesh.indice, mesh.vertice.size());
+	return stats;
+}
+
+std::vector<BaseVertex> BuildHMap(const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const std::function<float(int, int)>& f)
+{
+	std::vector<BaseVertex> vertice;
+
+	const float xsz = (max.X - min.X) / w;
+	const float ysz = (max.Y - min.Y) / h;
+	const float mweight = 4.0f;
+
+	vertice.reserve(w * h);
+	for (int y = 0; y < h; ++y) {
+		const float ry = (float(y) / float(h - 1));
+		const float fy = min.Y + (max.Y - min.Y) * ry;
+		for (int x = 0; x < w; ++x) {
+			const float rx = (float(x) / float(w - 1));
+			const float fx = min.X + (max.X - min.X) * rx;
+
+			const float tz = f(ox + x, oy + y);
+			const float zl = f(ox + x - 1, oy + y);
+			const float zr = f(ox + x + 1, oy + y);
+			const float zu = f(ox + x, oy + y - 1);
+			const float zd = f(ox + x, oy + y + 1);
+			const float zul = f(ox + x - 1, oy + y - 1);
+			const float zur = f(ox + x + 1, oy + y - 1);
+			const float zdl = f(ox + x - 1, oy + y + 1);
+			const float zdr = f(ox + x + 1, oy + y + 1);
+
+			const float dx = (mweight * (zl - zr) + (zul - zur) + (zdr - zdl)) / (2.0f + mweight);
+			const float dy = (mweight * (zu - zd) + (zul - zdl) + (zur - zdr)) / (2.0f + mweight);
+
+			const vec3 v0{ -2.0f * xsz, 0.0f, dx };
+			const vec3 v1{ 0.0f, -2.0f * ysz, dy };
+			const vec3 n = HMM_Normalize(HMM_Cross(v0, v1));
+
+			vertice.push_back({
+				{ fx, fy, tz },
+				{ n.X, n.Y, n.Z },
+				{ rx, ry },
+				0xffff00ff
+			});
+		}
+	}
+
+	return vertice;
+}
+
+namespace {
+
+int ResolveBorder(HeightBorder border, int i, int n)
+{
+	if (i >= 0 && i < n)
+		return i;
+	switch (border) {
+	case HeightBorder::Clamp: return i < 0 ? 0 : n - 1;
+	case HeightBorder::Wrap: return ((i % n) + n) % n;
+	default: return -1;
+	}
+}
+
+// lane wrappers so the normal kernel below is written once for every instruction set
+
+struct ScalarLanes
+{
+	using V = float;
+	static constexpr int N = 1;
+	static V set(float v) { return v; }
+	static V load(const float* p) { return *p; }
+	static void store(float* p, V v) { *p = v; }
+	static V add(V a, V b) { return a + b; }
+	static V sub(V a, V b) { return a - b; }
+	static V mul(V a, V b) { return a * b; }
+	static V div(V a, V b) { return a / b; }
+	static V sqrt(V a) { return std::sqrt(a); }
+	static V abs(V a) { return std::abs(a); }
+	static V min(V a, V b) { return std::min(a, b); }
+	static V max(V a, V b) { return std::max(a, b); }
+	// a where x is negative, b elsewhere
+	static V ifNegative(V x, V a, V b) { return x < 0.0f ? a : b; }
+	static V index(int i) { return float(i); }
+	// lane i gets the first two or three floats of rows[i]
+	static void rows2(const float* const rows[N], V& x, V& y) { x = rows[0][0]; y = rows[0][1]; }
+	static void rows3(const float* const rows[N], V& x, V& y, V& z) { x = rows[0][0]; y = rows[0][1]; z = rows[0][2]; }
+	// rows[i] becomes lane i of x, y, z, w
+	static void toRows(float* const rows[N], V x, V y, V z, V w)
+	{
+		rows[0][0] = x;
+		rows[0][1] = y;
+		rows[0][2] = z;
+		rows[0][3] = w;
+	}
+};
+
+#if defined(__SSE2__)
+struct SseLanes
+{
+	using V = __m128;
+	static constexpr int N = 4;
+	static V set(float v) { return _mm_set1_ps(v); }
+	static V load(const float* p) { return _mm_loadu_ps(p); }
+	static void store(float* p, V v) { _mm_storeu_ps(p, v); }
+	static V add(V a, V b) { return _mm_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm_div_ps(a, b); }
+	static V sqrt(V a) { return _mm_sqrt_ps(a); }
+	static V abs(V a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+	static V min(V a, V b) { return _mm_min_ps(a, b); }
+	static V max(V a, V b) { return _mm_max_ps(a, b); }
+	static V ifNegative(V x, V a, V b)
+	{
+		const V m = _mm_cmplt_ps(x, _mm_setzero_ps());
+		return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+	}
+	static V index(int i) { return _mm_add_ps(_mm_set1_ps(float(i)), _mm_setr_ps(0, 1, 2, 3)); }
+	static void rows2(const float* const rows[N], V& x, V& y)
+	{
+		auto pair = [] (const float* p) { return _mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(p))); };
+		const V lo = _mm_unpacklo_ps(pair(rows[0]), pair(rows[1]));
+		const V hi = _mm_unpacklo_ps(pair(rows[2]), pair(rows[3]));
+		x = _mm_movelh_ps(lo, hi);
+		y = _mm_movehl_ps(hi, lo);
+	}
+	// reads four floats per row
+	static void rows3(const float* const rows[N], V& x, V& y, V& z)
+	{
+		V r0 = _mm_loadu_ps(rows[0]), r1 = _mm_loadu_ps(rows[1]), r2 = _mm_loadu_ps(rows[2]), r3 = _mm_loadu_ps(rows[3]);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		x = r0;
+		y = r1;
+		z = r2;
+	}
+	static void toRows(float* const rows[N], V x, V y, V z, V w)
+	{
+		_MM_TRANSPOSE4_PS(x, y, z, w);
+		_mm_storeu_ps(rows[0], x);
+		_mm_storeu_ps(rows[1], y);
+		_mm_storeu_ps(rows[2], z);
+		_mm_storeu_ps(rows[3], w);
+	}
+};
+#endif
+
+#if defined(__AVX__)
+struct AvxLanes
+{
+	using V = __m256;
+	static constexpr int N = 8;
+	static V set(float v) { return _mm256_set1_ps(v); }
+	static V load(const float* p) { return _mm256_loadu_ps(p); }
+	static void store(float* p, V v) { _mm256_storeu_ps(p, v); }
+	static V add(V a, V b) { return _mm256_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm256_div_ps(a, b); }
+	static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+	static V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+	static V min(V a, V b) { return _mm256_min_ps(a, b); }
+	static V max(V a, V b) { return _mm256_max_ps(a, b); }
+	static V ifNegative(V x, V a, V b) { return _mm256_blendv_ps(b, a, x); }
+	static V index(int i) { return _mm256_add_ps(_mm256_set1_ps(float(i)), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)); }
+	static void rows2(const float* const rows[N], V& x, V& y)
+	{
+		__m128 x0, y0, x1, y1;
+		SseLanes::rows2(rows, x0, y0);
+		SseLanes::rows2(rows + 4, x1, y1);
+		x = _mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1);
+		y = _mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1);
+	}
+	// reads four floats per row
+	static void rows3(const float* const rows[N], V& x, V& y, V& z)
+	{
+		__m128 x0, y0, z0, x1, y1, z1;
+		SseLanes::rows3(rows, x0, y0, z0);
+		SseLanes::rows3(rows + 4, x1, y1, z1);
+		x = _mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1);
+		y = _mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1);
+		z = _mm256_insertf128_ps(_mm256_castps128_ps256(z0), z1, 1);
+	}
+	static void toRows(float* const rows[N], V x, V y, V z, V w)
+	{
+		SseLanes::toRows(rows, _mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z), _mm256_castps256_ps128(w));
+		SseLanes::toRows(rows + 4, _mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1), _mm256_extractf128_ps(w, 1));
+	}
+};
+#endif
+
+#if defined(__AVX__)
+using WideLanes = AvxLanes;
+#elif defined(__SSE2__)
+using WideLanes = SseLanes;
+#else
+using WideLanes = ScalarLanes;
+#endif
+
+struct HMapRow
+{
+	const float* up;
+	const float* mid;
+	const float* down;
+	float fy;
+	float ry;
+	float xsz;
+	float ysz;
+	float minx;
+	float spanx;
+	float lastx;
+};
+
+// same operation order as the std::function path so both produce identical vertices
+template <class L>
+int HMapRowKernel(const HMapRow& row, int x, int w, BaseVertex* out)
+{
+	using V = typename L::V;
+	const V mweight = L::set(4.0f);
+	const V norm = L::set(2.0f + 4.0f);
+	const V nxs = L::set(2.0f * row.ysz);
+	const V nys = L::set(2.0f * row.xsz);
+	const V nz = L::set(4.0f * row.xsz * row.ysz);
+	const V minx = L::set(row.minx);
+	const V spanx = L::set(row.spanx);
+	const V lastx = L::set(row.lastx);
+	const V one = L::set(1.0f);
+
+	alignas(32) float tz[L::N], fx[L::N], rx[L::N], nx[L::N], ny[L::N], nzs[L::N];
+
+	for (; x + L::N <= w; x += L::N) {
+		const V zul = L::load(row.up + x);
+		const V zu = L::load(row.up + x + 1);
+		const V zur = L::load(row.up + x + 2);
+		const V zl = L::load(row.mid + x);
+		const V zc = L::load(row.mid + x + 1);
+		const V zr = L::load(row.mid + x + 2);
+		const V zdl = L::load(row.down + x);
+		const V zd = L::load(row.down + x + 1);
+		const V zdr = L::load(row.down + x + 2);
+
+		const V dx = L::div(L::add(L::add(L::mul(mweight, L::sub(zl, zr)), L::sub(zul, zur)), L::sub(zdr, zdl)), norm);
+		const V dy = L::div(L::add(L::add(L::mul(mweight, L::sub(zu, zd)), L::sub(zul, zdl)), L::sub(zur, zdr)), norm);
+
+		const V cx = L::mul(nxs, dx);
+		const V cy = L::mul(nys, dy);
+		const V len = L::sqrt(L::add(L::add(L::mul(cx, cx), L::mul(cy, cy)), L::mul(nz, nz)));
+		// HMM_Normalize multiplies by the reciprocal rather than dividing
+		const V inv = L::div(one, len);
+
+		const V vrx = L::div(L::index(x), lastx);
+		L::store(tz, zc);
+		L::store(rx, vrx);
+		L::store(fx, L::add(minx, L::mul(spanx, vrx)));
+		L::store(nx, L::mul(cx, inv));
+		L::store(ny, L::mul(cy, inv));
+		L::store(nzs, L::mul(nz, inv));
+
+		for (int i = 0; i < L::N; ++i) {
+			out[x + i] = {
+				{ fx[i], row.fy, tz[i] },
+				{ nx[i], ny[i], nzs[i] },
+				{ rx[i], row.ry },
+				0xffff00ff
+			};
+		}
+	}
+
+	return x;
+}
+
+template <class L>
+struct Lanes3
+{
+	typename L::V x, y, z;
+};
+
+template <class L>
+Lanes3<L> Sub3(const Lanes3<L>& a, const Lanes3<L>& b)
+{
+	return { L::sub(a.x, b.x), L::sub(a.y, b.y), L::sub(a.z, b.z) };
+}
+
+template <class L>
+Lanes3<L> Scale3(const Lanes3<L>& a, typename L::V s)
+{
+	return { L::mul(a.x, s), L::mul(a.y, s), L::mul(a.z, s) };
+}
+
+template <class L>
+typename L::V Dot3(const Lanes3<L>& a, const Lanes3<L>& b)
+{
+	return L::add(L::add(L::mul(a.x, b.x), L::mul(a.y, b.y)), L::mul(a.z, b.z));
+}
+
+template <class L>
+Lanes3<L> Cross3(const Lanes3<L>& a, const Lanes3<L>& b)
+{
+	return {
+		L::sub(L::mul(a.y, b.z), L::mul(a.z, b.y)),
+		L::sub(L::mul(a.z, b.x), L::mul(a.x, b.z)),
+		L::sub(L::mul(a.x, b.y), L::mul(a.y, b.x)),
+	};
+}
+
+// Abramowitz & Stegun 4.4.45, off by less than 7e-5 radians which is plenty for weights
+template <class L>
+typename L::V Acos(typename L::V x)
+{
+	x = L::max(L::set(-1.0f), L::min(L::set(1.0f), x));
+	const typename L::V a = L::abs(x);
+	typename L::V p = L::add(L::mul(L::set(-0.0187293f), a), L::set(0.0742610f));
+	p = L::add(L::mul(p, a), L::set(-0.2121144f));
+	p = L::add(L::mul(p, a), L::set(1.5707288f));
+	const typename L::V r = L::mul(p, L::sqrt(L::sub(L::set(1.0f), a)));
+	return L::ifNegative(x, L::sub(L::set(3.14159265f), r), r);
+}
+
+// member m of corner k for the L::N triangles starting at t; pos and normal are followed by
+// more floats in BaseVertex, so the four float reads of rows3 stay inside the vertex
+template <class L>
+Lanes3<L> GatherCorner3(const BaseVertex* v, const uint32_t* idx, int t, int k, std::array<float, 3> BaseVertex::* m)
+{
+	const float* rows[L::N];
+	for (int i = 0; i < L::N; ++i)
+		rows[i] = (v[idx[3 * (t + i) + k]].*m).data();
+	Lanes3<L> r;
+	L::rows3(rows, r.x, r.y, r.z);
+	return r;
+}
+
+template <class L>
+void GatherCornerUV(const BaseVertex* v, const uint32_t* idx, int t, int k, typename L::V& u, typename L::V& w)
+{
+	const float* rows[L::N];
+	for (int i = 0; i < L::N; ++i)
+		rows[i] = v[idx[3 * (t + i) + k]].uv.data();
+	L::rows2(rows, u, w);
+}
+
+// interior angle at each corner, degenerate triangles give finite angles
+template <class L>
+void CornerAngles(const Lanes3<L> p[3], typename L::V angle[3])
+{
+	const typename L::V tiny = L::set(1e-30f);
+	const Lanes3<L> e01 = Sub3<L>(p[1], p[0]);
+	const Lanes3<L> e02 = Sub3<L>(p[2], p[0]);
+	const Lanes3<L> e12 = Sub3<L>(p[2], p[1]);
+	const typename L::V l01 = L::sqrt(Dot3<L>(e01, e01));
+	const typename L::V l02 = L::sqrt(Dot3<L>(e02, e02));
+	const typename L::V l12 = L::sqrt(Dot3<L>(e12, e12));
+	angle[0] = Acos<L>(L::div(Dot3<L>(e01, e02), L::add(L::mul(l01, l02), tiny)));
+	angle[1] = Acos<L>(L::div(L::sub(L::set(0.0f), Dot3<L>(e01, e12)), L::add(L::mul(l01, l12), tiny)));
+	angle[2] = Acos<L>(L::div(Dot3<L>(e02, e12), L::add(L::mul(l02, l12), tiny)));
+}
+
+// per corner face normal (its length is twice the area) times the corner angle, for triangles [t, end)
+template <class L>
+int NormalCornersKernel(const BaseVertex* v, const uint32_t* idx, int t, int end, std::array<float, 4>* corners)
+{
+	for (; t + L::N <= end; t += L::N) {
+		const Lanes3<L> p[3] = {
+			GatherCorner3<L>(v, idx, t, 0, &BaseVertex::pos),
+			GatherCorner3<L>(v, idx, t, 1, &BaseVertex::pos),
+			GatherCorner3<L>(v, idx, t, 2, &BaseVertex::pos),
+		};
+		typename L::V angle[3];
+		CornerAngles<L>(p, angle);
+		const Lanes3<L> face = Cross3<L>(Sub3<L>(p[1], p[0]), Sub3<L>(p[2], p[0]));
+		for (int k = 0; k < 3; ++k) {
+			float* rows[L::N];
+			for (int i = 0; i < L::N; ++i)
+				rows[i] = corners[3 * (t + i) + k].data();
+			L::toRows(rows, L::mul(face.x, angle[k]), L::mul(face.y, angle[k]), L::mul(face.z, angle[k]), L::set(0.0f));
+		}
+	}
+	return t;
+}
+
+// per corner uv derived tangent, projected on the corner's tangent plane, normalized then weighted
+// by the corner angle; w is +-angle, the handedness sign(dot(cross(n, t), b)) of the triangle as seen
+// from the corner normal, zero uv area gives zero
+template <class L>
+int TangentCornersKernel(const BaseVertex* v, const uint32_t* idx, int t, int end, std::array<float, 4>* corners)
+{
+	using V = typename L::V;
+	const V tiny = L::set(1e-30f);
+	for (; t + L::N <= end; t += L::N) {
+		const Lanes3<L> p[3] = {
+			GatherCorner3<L>(v, idx, t, 0, &BaseVertex::pos),
+			GatherCorner3<L>(v, idx, t, 1, &BaseVertex::pos),
+			GatherCorner3<L>(v, idx, t, 2, &BaseVertex::pos),
+		};
+		V angle[3];
+		CornerAngles<L>(p, angle);
+
+		V uv[3][2];
+		for (int k = 0; k < 3; ++k)
+			GatherCornerUV<L>(v, idx, t, k, uv[k][0], uv[k][1]);
+		const V du1 = L::sub(uv[1][0], uv[0][0]);
+		const V dv1 = L::sub(uv[1][1], uv[0][1]);
+		const V du2 = L::sub(uv[2][0], uv[0][0]);
+		const V dv2 = L::sub(uv[2][1], uv[0][1]);
+		const V det = L::sub(L::mul(du1, dv2), L::mul(du2, dv1));
+		// 1 / det, or 0 for a degenerate uv triangle
+		const V r = L::div(det, L::add(L::mul(det, det), tiny));
+		const Lanes3<L> e01 = Sub3<L>(p[1], p[0]);
+		const Lanes3<L> e02 = Sub3<L>(p[2], p[0]);
+		const Lanes3<L> s = Scale3<L>(Sub3<L>(Scale3<L>(e01, dv2), Scale3<L>(e02, dv1)), r);
+		// cross(s, b) is cross(e01, e02) / det
+		const Lanes3<L> sb = Scale3<L>(Cross3<L>(e01, e02), r);
+
+		for (int k = 0; k < 3; ++k) {
+			const Lanes3<L> n = GatherCorner3<L>(v, idx, t, k, &BaseVertex::normal);
+			const Lanes3<L> ts = Sub3<L>(s, Scale3<L>(n, Dot3<L>(n, s)));
+			const V ws = L::div(angle[k], L::add(L::sqrt(Dot3<L>(ts, ts)), tiny));
+			const V h = Dot3<L>(n, sb);
+			const V hs = L::mul(angle[k], L::div(h, L::add(L::abs(h), tiny)));
+			float* rows[L::N];
+			for (int i = 0; i < L::N; ++i)
+				rows[i] = corners[3 * (t + i) + k].data();
+			L::toRows(rows, L::mul(ts.x, ws), L::mul(ts.y, ws), L::mul(ts.z, ws), hs);
+		}
+	}
+	return t;
+}
+
+// calls fn(begin, end) over [0, count) in blocks, on the workers of jobs when one is given
+void ForRanges(JobSystem* jobs, int count, int block, const std::function<void(int, int)>& fn)
+{
+	const int blocks = (count + block - 1) / block;
+	if (jobs && blocks > 1) {
+		jobs->parallelFor(blocks, [&] (int b) { fn(b * block, std::min(count, (b + 1) * block)); });
+	} else if (count > 0) {
+		fn(0, count);
+	}
+}
+
+constexpr int MeshRangeSize = 16384;
+
+// kernel(begin, end, out) writes the per corner values of triangles [begin, end); a wave of ranges
+// runs on jobs into scratch that is reused, then it is summed into acc in triangle order so results
+// do not depend on the worker count
+using CornerKernel = std::function<void(int begin, int end, std::array<float, 4>* out)>;
+
+void AccumulateCorners(const std::vector<uint32_t>& indice, JobSystem* jobs, const CornerKernel& kernel, std::vector<std::array<float, 4>>& acc)
+{
+	const int tris = int(indice.size() / 3);
+	const size_t stride = 3 * size_t(MeshRangeSize);
+	const int wave = jobs ? jobs->workerCount() + 1 : 1;
+	std::vector<std::array<float, 4>> scratch(wave * stride);
+	for (int first = 0; first < tris; first += wave * MeshRangeSize) {
+		const int ranges = std::min(wave, (tris - first + MeshRangeSize - 1) / MeshRangeSize);
+		auto range = [&] (int r) {
+			const int begin = first + r * MeshRangeSize;
+			kernel(begin, std::min(tris, begin + MeshRangeSize), &scratch[r * stride]);
+		};
+		if (jobs && ranges > 1) {
+			jobs->parallelFor(ranges, range);
+		} else {
+			for (int r = 0; r < ranges; ++r)
+				range(r);
+		}
+
+		// the ranges of a wave sit back to back in scratch
+		const size_t corners = 3 * size_t(std::min(tris, first + ranges * MeshRangeSize) - first);
+		const uint32_t* idx = indice.data() + 3 * size_t(first);
+		for (size_t c = 0; c < corners; ++c) {
+			float* dst = acc[idx[c]].data();
+#if defined(__SSE2__)
+			_mm_storeu_ps(dst, _mm_add_ps(_mm_loadu_ps(dst), _mm_loadu_ps(scratch[c].data())));
+#else
+			for (int k = 0; k < 4; ++k)
+				dst[k] += scratch[c][k];
+#endif
+		}
+	}
+}
+
+}
+
+void ComputeNormals(MeshData& mesh, JobSystem* jobs)
+{
+	PIPO_ZONE("ComputeNormals");
+	std::vector<std::array<float, 4>> acc(mesh.vertice.size(), { 0.0f, 0.0f, 0.0f, 0.0f });
+	AccumulateCorners(mesh.indice, jobs, [&] (int begin, int end, std::array<float, 4>* out) {
+		const uint32_t* idx = mesh.indice.data() + 3 * size_t(begin);
+		const int t = NormalCornersKernel<WideLanes>(mesh.vertice.data(), idx, 0, end - begin, out);
+		NormalCornersKernel<ScalarLanes>(mesh.vertice.data(), idx, t, end - begin, out);
+	}, acc);
+
+	ForRanges(jobs, int(mesh.vertice.size()), MeshRangeSize, [&] (int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			const std::array<float, 4>& n = acc[i];
+			const float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+			mesh.vertice[i].normal = len > 0.0f ? std::array<float, 3>{ n[0] / len, n[1] / len, n[2] / len } : std::array<float, 3>{ 0.0f, 0.0f, 1.0f };
+		}
+	});
+	mesh.hasNormals = true;
+}
+
+void ComputeTangents(MeshData& mesh, JobSystem* jobs)
+{
+	PIPO_ZONE("ComputeTangents");
+	std::vector<std::array<float, 4>> acc(mesh.vertice.size(), { 0.0f, 0.0f, 0.0f, 0.0f });
+	AccumulateCorners(mesh.indice, jobs, [&] (int begin, int end, std::array<float, 4>* out) {
+		const uint32_t* idx = mesh.indice.data() + 3 * size_t(begin);
+		const int t = TangentCornersKernel<WideLanes>(mesh.vertice.data(), idx, 0, end - begin, out);
+		TangentCornersKernel<ScalarLanes>(mesh.vertice.data(), idx, t, end - begin, out);
+	}, acc);
+
+	mesh.tangents.resize(mesh.vertice.size());
+	ForRanges(jobs, int(mesh.vertice.size()), MeshRangeSize, [&] (int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			const std::array<float, 3>& n = mesh.vertice[i].normal;
+			std::array<float, 4> t = acc[i];
+			const float d = n[0] * t[0] + n[1] * t[1] + n[2] * t[2];
+			for (int k = 0; k < 3; ++k)
+				t[k] -= n[k] * d;
+			float len2 = t[0] * t[0] + t[1] * t[1] + t[2] * t[2];
+			if (len2 <= 1e-24f) {
+				// no usable uvs around this vertex, any direction in the tangent plane will do
+				t = std::abs(n[0]) < 0.9f ? std::array<float, 4>{ 0.0f, n[2], -n[1], t[3] } : std::array<float, 4>{ -n[2], 0.0f, n[0], t[3] };
+				len2 = t[0] * t[0] + t[1] * t[1] + t[2] * t[2];
+			}
+			const float rl = 1.0f / std::sqrt(len2);
+			mesh.tangents[i] = { t[0] * rl, t[1] * rl, t[2] * rl, t[3] < 0.0f ? -1.0f : 1.0f };
+		}
+	});
+}
+
+std::vector<BaseVertex> BuildHMap(const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const HeightField& field)
+{
+	if (field.data == nullptr || field.width <= 0 || field.height <= 0)
+		return {};
+
+	// gather the tile plus a one sample border once, so the kernel only does unaligned loads
+	const int pw = w + 2;
+	const int ph = h + 2;
+	std::vector<float> window(pw * ph);
+	for (int y = 0; y < ph; ++y) {
+		float* dst = &window[y * pw];
+		const int sy = ResolveBorder(field.border, oy + y - 1, field.height);
+		if (sy < 0) {
+			std::fill(dst, dst + pw, field.borderValue);
+			continue;
+		}
+		const float* src = field.data + ptrdiff_t(sy) * field.stride;
+		const int x0 = std::clamp(1 - ox, 0, pw);
+		const int x1 = std::clamp(field.width - ox + 1, x0, pw);
+		for (int x = 0; x < x0; ++x) {
+			const int sx = ResolveBorder(field.border, ox + x - 1, field.width);
+			dst[x] = sx < 0 ? field.borderValue : src[sx];
+		}
+		if (x1 > x0)
+			memcpy(dst + x0, src + ox + x0 - 1, (x1 - x0) * sizeof(float));
+		for (int x = x1; x < pw; ++x) {
+			const int sx = ResolveBorder(field.border, ox + x - 1, field.width);
+			dst[x] = sx < 0 ? field.borderValue : src[sx];
+		}
+	}
+
+	const float xsz = (max.X - min.X) / w;
+	const float ysz = (max.Y - min.Y) / h;
+
+	std::vector<BaseVertex> vertice(w * h);
+	for (int y = 0; y < h; ++y) {
+		const float ry = (float(y) / float(h - 1));
+		const HMapRow row{
+			&window[y * pw],
+			&window[(y + 1) * pw],
+			&window[(y + 2) * pw],
+			min.Y + (max.Y - min.Y) * ry,
+			ry,
+			xsz,
+			ysz,
+			min.X,
+			max.X - min.X,
+			float(w - 1),
+		};
+		BaseVertex* out = &vertice[y * w];
+		int x = HMapRowKernel<WideLanes>(row, 0, w, out);
+		HMapRowKernel<ScalarLanes>(row, x, w, out);
+	}
+
+	return vertice;
+}
+
+Mesh MakeHMap(Context& context, const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const HeightField& field)
+{
+	PIPO_ZONE("MakeHMap");
+	return UploadHMap(context, w, h, BuildHMap(ox, oy, w, h, min, max, field));
+}
+
+std::pair<sg_buffer, int> HMapIndexBuffer(Context& context, const int w, const int h, const int level, const int stitch)
+{
+	auto& hmapIid = context.hmapIndexBuffer[{ w, h, level, stitch }];
+	if (hmapIid.second == 0) {
+		const int s = 1 << level;
+		const int cw = (w - 1) / s;
+		const int ch = (h - 1) / s;
+
+		// edge vertices facing a coarser neighbour snap onto its grid, which keeps the seam crack free
+		auto index = [&] (int x, int y) {
+			if ((x == 0 && (stitch & HMapEdgeLeft)) || (x == w - 1 && (stitch & HMapEdgeRight)))
+				y -= y % (2 * s);
+			if ((y == 0 && (stitch & HMapEdgeTop)) || (y == h - 1 && (stitch & HMapEdgeBottom)))
+				x -= x % (2 * s);
+			return uint32_t(y * w + x);
+		};
+
+		std::vector<uint32_t> indice;
+		indice.reserve(6 * cw * ch);
+		auto push = [&] (uint32_t a, uint32_t b, uint32_t c) {
+			if (a != b && b != c && c != a)
+				indice.insert(indice.end(), { a, b, c });
+		};
+		for (int cy = 0; cy < ch; ++cy) {
+			for (int cx = 0; cx < cw; ++cx) {
+				const int x = cx * s;
+				const int y = cy * s;
+				const uint32_t i0 = index(x, y);
+				const uint32_t i1 = index(x + s, y);
+				const uint32_t i2 = index(x, y + s);
+				const uint32_t i3 = index(x + s, y + s);
+				if ((cx ^ cy) & 1) {
+					push(i0, i3, i2);
+					push(i1, i3, i0);
+				} else {
+					push(i0, i1, i2);
+					push(i1, i3, i2);
+				}
+			}
+		}
+		OptimizeVertexCache(indice, size_t(w * h));
+
+		// tiles above 256x256 samples get 32-bit indices
+		bool wide;
+		hmapIid = { MakeIndexBuffer(context, indice, wide), indice.size() };
+	}
+	return hmapIid;
+}
+
+HMapLod ComputeHMapLod(const int ox, const int oy, const int w, const int h, const HeightField& field)
+{
+	HMapLod lod;
+	if (field.data == nullptr)
+		return lod;
+
+	auto at = [&] (int x, int y) {
+		const int sx = ResolveBorder(field.border, ox + x, field.width);
+		const int sy = ResolveBorder(field.border, oy + y, field.height);
+		return sx < 0 || sy < 0 ? field.borderValue : field.data[ptrdiff_t(sy) * field.stride + sx];
+	};
+
+	for (int l = 1; l < HMapMaxLods; ++l) {
+		const int s = 1 << l;
+		if ((w - 1) % s != 0 || (h - 1) % s != 0)
+			break;
+
+		// bilinear over the coarse cell is close enough to the triangle the level actually draws
+		float error = lod.error[l - 1];
+		for (int y = 0; y < h; ++y) {
+			const int y0 = std::min(y - y % s, h - 1 - s);
+			const float fy = float(y - y0) / float(s);
+			for (int x = 0; x < w; ++x) {
+				const int x0 = std::min(x - x % s, w - 1 - s);
+				const float fx = float(x - x0) / float(s);
+				const float top = at(x0, y0) + fx * (at(x0 + s, y0) - at(x0, y0));
+				const float bottom = at(x0, y0 + s) + fx * (at(x0 + s, y0 + s) - at(x0, y0 + s));
+				error = std::max(error, std::abs(at(x, y) - (top + fy * (bottom - top))));
+			}
+		}
+		lod.error[l] = error;
+		lod.levels = l + 1;
+	}
+	return lod;
+}
+
+int SelectHMapLod(const Context& ctx, const HMapLod& lod, const Bounds& bounds, const float pixelError)
+{
+	vec3 d;
+	for (int i = 0; i < 3; ++i)
+		d.Elements[i] = std::max({ bounds.min.Elements[i] - ctx.eye.Elements[i], 0.0f, ctx.eye.Elements[i] - bounds.max.Elements[i] });
+	const float dist = std::max(HMM_Length(d), 1e-3f);
+
+	// projected size of one height unit at that distance, in pixels
+	const float scale = 0.5f * float(ctx.frameHeight) * ctx.proj.Elements[1][1] / dist;
+
+	int level = 0;
+	while (level + 1 < lod.levels && lod.error[level + 1] * scale <= pixelError)
+		++level;
+	return level;
+}
+
+void BalanceHMapLods(std::vector<int>& levels, const int w, const int h)
+{
+	// only ever refines, so it settles in at most HMapMaxLods passes
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				int& l = levels[y * w + x];
+				int limit = l;
+				if (x > 0)
+					limit = std::min(limit, levels[y * w + x - 1] + 1);
+				if (x + 1 < w)
+					limit = std::min(limit, levels[y * w + x + 1] + 1);
+				if (y > 0)
+					limit = std::min(limit, levels[(y - 1) * w + x] + 1);
+				if (y + 1 < h)
+					limit = std::min(limit, levels[(y + 1) * w + x] + 1);
+				if (limit < l) {
+					l = limit;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+int HMapStitch(const int level, const int left, const int right, const int top, const int bottom)
+{
+	// missing neighbours are passed as -1
+	return (left > level ? HMapEdgeLeft : 0)
+		| (right > level ? HMapEdgeRight : 0)
+		| (top > level ? HMapEdgeTop : 0)
+		| (bottom > level ? HMapEdgeBottom : 0);
+}
+
+Mesh UploadHMap(Context& context, const int w, const int h, const std::vector<BaseVertex>& vertice)
+{
+	Mesh msh = MakeMesh(context, vertice, HMapIndexBuffer(context, w, h));
+	if (uint32_t(w * h) > MaxIndex16 + 1)
+		msh.pip = msh.pip->wide;
+	return msh;
+}
+
+Mesh MakeHMap(Context& context, const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const std::function<float(int, int)>& f)
+{
+	PIPO_ZONE("MakeHMap");
+	return UploadHMap(context, w, h, BuildHMap(ox, oy, w, h, min, max, f));
+}
+
+std::vector<TerrainVertex> CompactHMap(const std::vector<BaseVertex>& vertice, const std::function<float(const BaseVertex&)>& layer)
+{
+	auto snorm = [] (float v) {
+		return uint32_t(uint8_t(int8_t(std::lround(std::clamp(v, -1.0f, 1.0f) * 127.0f))));
+	};
+
+	// w only has the 7 positive bits of the snorm byte: 4 bits of layer, 3 bits of blend
+	auto packLayer = [] (float v) {
+		v = std::clamp(v, 0.0f, float(MaxTerrainLayer));
+		const float index = std::floor(v);
+		return uint32_t(index) * 8 + uint32_t(std::lround((v - index) * 7.0f));
+	};
+
+	std::vector<TerrainVertex> compact(vertice.size());
+	for (size_t i = 0; i < vertice.size(); ++i) {
+		const BaseVertex& v = vertice[i];
+		const uint32_t l = layer ? packLayer(layer(v)) : 0;
+		compact[i] = {
+			v.pos[2],
+			snorm(v.normal[0]) | (snorm(v.normal[1]) << 8) | (snorm(v.normal[2]) << 16) | (l << 24),
+		};
+	}
+	return compact;
+}
+
+HeightQuery::HeightQuery(const HeightField& field, const vec2 origin, const vec2 spacing)
+	: _field(field)
+	, _origin(origin)
+	, _spacing(spacing)
+	, _inv{ 1.0f / spacing.X, 1.0f / spacing.Y }
+{
+	PIPO_ZONE("HeightQuery");
+	// no pyramid: sample leaves its outputs alone and raycast never hits
+	if (!field.data || field.width < 2 || field.height < 2 || field.stride < field.width)
+		return;
+
+	Level base{ field.width - 1, field.height - 1, {} };
+	base.cells.resize(size_t(base.w) * base.h);
+	for (int y = 0; y < base.h; ++y) {
+		const float* r0 = field.data + size_t(y) * field.stride;
+		const float* r1 = r0 + field.stride;
+		for (int x = 0; x < base.w; ++x) {
+			const float a = std::min(r0[x], r0[x + 1]);
+			const float b = std::min(r1[x], r1[x + 1]);
+			const float c = std::max(r0[x], r0[x + 1]);
+			const float d = std::max(r1[x], r1[x + 1]);
+			base.cells[size_t(y) * base.w + x] = { std::min(a, b), std::max(c, d) };
+		}
+	}
+	_levels.push_back(std::move(base));
+
+	while (_levels.back().w > 1 || _levels.back().h > 1) {
+		const Level& fine = _levels.back();
+		Level coarse{ (fine.w + 1) / 2, (fine.h + 1) / 2, {} };
+		coarse.cells.resize(size_t(coarse.w) * coarse.h);
+		for (int y = 0; y < coarse.h; ++y) {
+			for (int x = 0; x < coarse.w; ++x) {
+				MinMax m{ 1e30f, -1e30f };
+				for (int k = 0; k < 4; ++k) {
+					const int fx = 2 * x + (k & 1);
+					const int fy = 2 * y + (k >> 1);
+					if (fx < fine.w && fy < fine.h) {
+						const MinMax& f = fine.cells[size_t(fy) * fine.w + fx];
+						m = { std::min(m.lo, f.lo), std::max(m.hi, f.hi) };
+					}
+				}
+				coarse.cells[size_t(y) * coarse.w + x] = m;
+			}
+		}
+		_levels.push_back(std::move(coarse));
+	}
+}
+
+float HeightQuery::at(const int x, const int y) const
+{
+	const int rx = ResolveBorder(_field.border, x, _field.width);
+	const int ry = ResolveBorder(_field.border, y, _field.height);
+	return rx < 0 || ry < 0 ? _field.borderValue : _field.data[size_t(ry) * _field.stride + rx];
+}
+
+// c00, c10, c01, c11
+void HeightQuery::corners(const int x, const int y, float c[4]) const
+{
+	if (x >= 0 && y >= 0 && x + 1 < _field.width && y + 1 < _field.height) {
+		const float* r0 = _field.data + size_t(y) * _field.stride + x;
+		c[0] = r0[0];
+		c[1] = r0[1];
+		c[2] = r0[_field.stride];
+		c[3] = r0[_field.stride + 1];
+	} else {
+		c[0] = at(x, y);
+		c[1] = at(x + 1, y);
+		c[2] = at(x, y + 1);
+		c[3] = at(x + 1, y + 1);
+	}
+}
+
+float HeightQuery::height(const vec2 p) const
+{
+	float h = 0.0f;
+	sample(&p, 1, &h, nullptr);
+	return h;
+}
+
+vec3 HeightQuery::normal(const vec2 p) const
+{
+	vec3 n{ 0, 0, 1 };
+	sample(&p, 1, nullptr, &n);
+	return n;
+}
+
+namespace {
+
+// bilinear height and the normal of the bilinear patch from the four corners of a cell
+inline void BilinearSample(const float c[4], float fx, float fy, vec2 inv, float* h, vec3* n)
+{
+	const float dx = c[1] - c[0];
+	const float dy = c[2] - c[0];
+	const float dxy = c[0] - c[1] - c[2] + c[3];
+	if (h)
+		*h = c[0] + fx * dx + fy * dy + fx * fy * dxy;
+	if (n) {
+		const float gx = (dx + fy * dxy) * inv.X;
+		const float gy = (dy + fx * dxy) * inv.Y;
+		const float rl = 1.0f / std::sqrt(gx * gx + gy * gy + 1.0f);
+		*n = { -gx * rl, -gy * rl, rl };
+	}
+}
+
+}
+
+void HeightQuery::sample(const vec2* p, const int n, float* heights, vec3* normals) const
+{
+	if (_levels.empty())
+		return;
+
+	int i = 0;
+#if defined(__SSE2__)
+	// clamped fields never leave the data, so four lanes share the cell math and only the gathers are scalar
+	if (_field.border == HeightBorder::Clamp) {
+		const __m128 ox = _mm_set1_ps(_origin.X);
+		const __m128 oy = _mm_set1_ps(_origin.Y);
+		const __m128 ix = _mm_set1_ps(_inv.X);
+		const __m128 iy = _mm_set1_ps(_inv.Y);
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 maxx = _mm_set1_ps(float(_field.width - 1));
+		const __m128 maxy = _mm_set1_ps(float(_field.height - 1));
+		const __m128i lastx = _mm_set1_epi32(_field.width - 2);
+		const __m128i lasty = _mm_set1_epi32(_field.height - 2);
+		const __m128 one = _mm_set1_ps(1.0f);
+		for (; i + 4 <= n; i += 4) {
+			const __m128 a = _mm_loadu_ps(&p[i].X);
+			const __m128 b = _mm_loadu_ps(&p[i + 2].X);
+			const __m128 px = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+			const __m128 py = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+			const __m128 gx = _mm_min_ps(maxx, _mm_max_ps(zero, _mm_mul_ps(_mm_sub_ps(px, ox), ix)));
+			const __m128 gy = _mm_min_ps(maxy, _mm_max_ps(zero, _mm_mul_ps(_mm_sub_ps(py, oy), iy)));
+			// truncation is floor for positive values, the last sample row / column stays in the last cell
+			__m128i cx = _mm_cvttps_epi32(gx);
+			__m128i cy = _mm_cvttps_epi32(gy);
+			cx = _mm_sub_epi32(cx, _mm_and_si128(_mm_cmpgt_epi32(cx, lastx), _mm_set1_epi32(1)));
+			cy = _mm_sub_epi32(cy, _mm_and_si128(_mm_cmpgt_epi32(cy, lasty), _mm_set1_epi32(1)));
+			const __m128 fx = _mm_sub_ps(gx, _mm_cvtepi32_ps(cx));
+			const __m128 fy = _mm_sub_ps(gy, _mm_cvtepi32_ps(cy));
+
+			alignas(16) int32_t xs[4];
+			alignas(16) int32_t ys[4];
+			_mm_store_si128(reinterpret_cast<__m128i*>(xs), cx);
+			_mm_store_si128(reinterpret_cast<__m128i*>(ys), cy);
+			alignas(16) float c[4][4];
+			for (int k = 0; k < 4; ++k) {
+				const float* r0 = _field.data + size_t(ys[k]) * _field.stride + xs[k];
+				c[0][k] = r0[0];
+				c[1][k] = r0[1];
+				c[2][k] = r0[_field.stride];
+				c[3][k] = r0[_field.stride + 1];
+			}
+			const __m128 c00 = _mm_load_ps(c[0]);
+			const __m128 dx = _mm_sub_ps(_mm_load_ps(c[1]), c00);
+			const __m128 dy = _mm_sub_ps(_mm_load_ps(c[2]), c00);
+			const __m128 dxy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(c[3]), _mm_load_ps(c[1])), dy);
+
+			if (heights) {
+				const __m128 h = _mm_add_ps(c00, _mm_add_ps(_mm_mul_ps(fx, dx), _mm_mul_ps(fy, _mm_add_ps(dy, _mm_mul_ps(fx, dxy)))));
+				_mm_storeu_ps(heights + i, h);
+			}
+			if (normals) {
+				const __m128 nx = _mm_mul_ps(_mm_add_ps(dx, _mm_mul_ps(fy, dxy)), ix);
+				const __m128 ny = _mm_mul_ps(_mm_add_ps(dy, _mm_mul_ps(fx, dxy)), iy);
+				const __m128 rl = _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(one, _mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)))));
+				alignas(16) float out[3][4];
+				_mm_store_ps(out[0], _mm_mul_ps(_mm_sub_ps(zero, nx), rl));
+				_mm_store_ps(out[1], _mm_mul_ps(_mm_sub_ps(zero, ny), rl));
+				_mm_store_ps(out[2], rl);
+				for (int k = 0; k < 4; ++k)
+					normals[i + k] = { out[0][k], out[1][k], out[2][k] };
+			}
+		}
+	}
+#endif
+	for (; i < n; ++i) {
+		float gx = (p[i].X - _origin.X) * _inv.X;
+		float gy = (p[i].Y - _origin.Y) * _inv.Y;
+		int cx = int(std::floor(gx));
+		int cy = int(std::floor(gy));
+		if (_field.border == HeightBorder::Clamp) {
+			gx = std::clamp(gx, 0.0f, float(_field.width - 1));
+			gy = std::clamp(gy, 0.0f, float(_field.height - 1));
+			cx = std::min(int(gx), _field.width - 2);
+			cy = std::min(int(gy), _field.height - 2);
+		}
+		float c[4];
+		corners(cx, cy, c);
+		BilinearSample(c, gx - float(cx), gy - float(cy), _inv, heights ? heights + i : nullptr, normals ? normals + i : nullptr);
+	}
+}
+
+std::optional<float> HeightQuery::raycast(const vec3 origin, const vec3 dir, const float maxT) const
+{
+	if (_levels.empty())
+		return {};
+
+	// grid space, a cell is one unit wide and heights stay as they are
+	const float ox = (origin.X - _origin.X) * _inv.X;
+	const float oy = (origin.Y - _origin.Y) * _inv.Y;
+	const float dx = dir.X * _inv.X;
+	const float dy = dir.Y * _inv.Y;
+	const float rdx = dx != 0.0f ? 1.0f / dx : 1e30f;
+	const float rdy = dy != 0.0f ? 1.0f / dy : 1e30f;
+
+	// t range of the ray over [x0, x1] x [y0, y1], empty when t0 > t1
+	auto slab = [&] (float x0, float x1, float y0, float y1) -> std::pair<float, float> {
+		float t0 = 0.0f;
+		float t1 = maxT;
+		if (dx != 0.0f) {
+			const float a = (x0 - ox) * rdx;
+			const float b = (x1 - ox) * rdx;
+			t0 = std::max(t0, std::min(a, b));
+			t1 = std::min(t1, std::max(a, b));
+		} else if (ox < x0 || ox > x1) {
+			return { 1.0f, 0.0f };
+		}
+		if (dy != 0.0f) {
+			const float a = (y0 - oy) * rdy;
+			const float b = (y1 - oy) * rdy;
+			t0 = std::max(t0, std::min(a, b));
+			t1 = std::min(t1, std::max(a, b));
+		} else if (oy < y0 || oy > y1) {
+			return { 1.0f, 0.0f };
+		}
+		return { t0, t1 };
+	};
+
+	// exact hit with the cell's bilinear patch, the height above it z(t) - h(t) is quadratic in t
+	auto cellHit = [&] (int x, int y, float t0, float t1) -> std::optional<float> {
+		float c[4];
+		corners(x, y, c);
+		const float bx = c[1] - c[0];
+		const float by = c[2] - c[0];
+		const float bxy = c[0] - c[1] - c[2] + c[3];
+		const float u = ox - float(x);
+		const float v = oy - float(y);
+		const float qa = -bxy * dx * dy;
+		const float qb = dir.Z - (bx * dx + by * dy + bxy * (u * dy + v * dx));
+		const float qc = origin.Z - (c[0] + bx * u + by * v + bxy * u * v);
+		auto f = [&] (float t) { return (qa * t + qb) * t + qc; };
+		if (f(t0) <= 0.0f)
+			return t0;
+		if (std::abs(qa) < 1e-12f) {
+			if (qb >= 0.0f)
+				return {};
+			const float t = -qc / qb;
+			return t <= t1 ? std::optional<float>(t) : std::nullopt;
+		}
+		const float disc = qb * qb - 4.0f * qa * qc;
+		if (disc < 0.0f)
+			return {};
+		const float sq = std::sqrt(disc);
+		// f(t0) > 0, so the first root past t0 is where the ray goes under
+		const float r0 = (-qb - sq) / (2.0f * qa);
+		const float r1 = (-qb + sq) / (2.0f * qa);
+		const float lo = std::min(r0, r1);
+		const float hi = std::max(r0, r1);
+		if (lo >= t0 && lo <= t1)
+			return lo;
+		if (hi >= t0 && hi <= t1)
+			return hi;
+		return {};
+	};
+
+	// maximum mipmap walk: step over whole cells the ray passes above, climbing a level when a step
+	// leaves the parent cell and descending where it gets close, the exact test only runs on level 0 cells
+	const auto [tmin, tmax] = slab(0.0f, float(_field.width - 1), 0.0f, float(_field.height - 1));
+	if (tmin > tmax)
+		return {};
+
+	// nudges lookups past the boundary the ray just crossed
+	const float eps = 1e-4f / std::max({ std::abs(dx), std::abs(dy), 1e-6f });
+	const int top = int(_levels.size()) - 1;
+	int level = 0;
+	float t = tmin;
+	while (t <= tmax) {
+		const float px = ox + dx * (t + eps);
+		const float py = oy + dy * (t + eps);
+		const Level& lv = _levels[level];
+		// inside the field px and py are at worst a nudge below 0, truncating is flooring
+		const int x = std::clamp(int(px) >> level, 0, lv.w - 1);
+		const int y = std::clamp(int(py) >> level, 0, lv.h - 1);
+		const float size = float(1 << level);
+		const float x0 = float(x) * size;
+		const float y0 = float(y) * size;
+		float exit = tmax;
+		if (dx != 0.0f)
+			exit = std::min(exit, ((dx > 0.0f ? x0 + size : x0) - ox) * rdx);
+		if (dy != 0.0f)
+			exit = std::min(exit, ((dy > 0.0f ? y0 + size : y0) - oy) * rdy);
+		exit = std::max(exit, t);
+
+		auto step = [&] {
+			t = std::max(exit, t + eps);
+			const int nx = int(ox + dx * (t + eps)) >> (level + 1);
+			const int ny = int(oy + dy * (t + eps)) >> (level + 1);
+			if (level < top && (nx != x >> 1 || ny != y >> 1))
+				++level;
+		};
+
+		const MinMax& mm = lv.cells[size_t(y) * lv.w + x];
+		const float z0 = origin.Z + dir.Z * t;
+		const float z1 = origin.Z + dir.Z * exit;
+		if (std::min(z0, z1) > mm.hi) {
+			// the whole cell is below the ray
+			step();
+		} else if (std::max(z0, z1) < mm.lo) {
+			// under everything in the cell, it went under right where it came in
+			return t;
+		} else if (level > 0) {
+			--level;
+		} else {
+			if (const std::optional<float> hit = cellHit(x, y, t, exit); hit)
+				return hit;
+			step();
+		}
+	}
+	return {};
+}
+
+sg_buffer HMapGridBuffer(Context& context, const int w, const int h, const vec2 min, const vec2 max)
+{
+	sg_buffer& grid = context.hmapGridBuffer[{ w, h, min.X, min.Y, max.X, max.Y }];
+	if (grid.id == 0) {
+		// same x/y/uv layout as BuildHMap
+		std::vector<TerrainGridVertex> vertice;
+		vertice.reserve(w * h);
+		for (int y = 0; y < h; ++y) {
+			const float ry = (float(y) / float(h - 1));
+			for (int x = 0; x < w; ++x) {
+				const float rx = (float(x) / float(w - 1));
+				vertice.push_back({ { min.X + (max.X - min.X) * rx, min.Y + (max.Y - min.Y) * ry, rx, ry } });
+			}
+		}
+		grid = MakeBuffer(context, {
+			.type = SG_BUFFERTYPE_VERTEXBUFFER,
+			.data = { &vertice[0], vertice.size() * sizeof(TerrainGridVertex) },
+		});
+	}
+	return grid;
+}
+
+namespace {
+
+// takes over the reference on vid, the index and grid buffers are shared with the caches
+Mesh MakeTerrain(Context& context, sg_buffer vid, const int w, const int h, const vec2 min, const vec2 max, const Bounds& bounds)
+{
+	const std::pair<sg_buffer, int> iid = HMapIndexBuffer(context, w, h);
+
+	Mesh msh;
+	msh.pip = uint32_t(w * h) > MaxIndex16 + 1 ? &context.plTerrainWide : &context.plTerrain;
+	msh.diffuse = context.txWhite;
+	msh.vid = vid;
+	msh.iid = iid.first;
+	msh.pcount = iid.second;
+	msh.bounds = bounds;
+	msh.grid = HMapGridBuffer(context, w, h, min, max);
+	RetainBuffer(context, msh.iid);
+	RetainBuffer(context, msh.grid);
+	return msh;
+}
+
+Bounds TerrainBounds(const vec2 min, const vec2 max, const std::vector<TerrainVertex>& vertice)
+{
+	Bounds bounds;
+	for (const TerrainVertex& v : vertice) {
+		bounds.min.Z = std::min(bounds.min.Z, v.height);
+		bounds.max.Z = std::max(bounds.max.Z, v.height);
+	}
+	bounds.min.X = min.X;
+	bounds.min.Y = min.Y;
+	bounds.max.X = max.X;
+	bounds.max.Y = max.Y;
+	return bounds;
+}
+
+}
+
+Mesh UploadTerrain(Context& context, const int w, const int h, const vec2 min, const vec2 max, const std::vector<TerrainVertex>& vertice)
+{
+	const Bounds bounds = TerrainBounds(min, max, vertice);
+	const sg_buffer vid = MakeBuffer(context, {
+		.type = SG_BUFFERTYPE_VERTEXBUFFER,
+		.data = { &vertice[0], vertice.size() * sizeof(TerrainVertex) },
+	});
+	return MakeTerrain(context, vid, w, h, min, max, bounds);
+}
+
+void SetTerrainLayers(Context& context, Mesh& mesh, const Texture& layers)
+{
+	if (layers.type == SG_IMAGETYPE_ARRAY)
+		mesh.pip = mesh.pip->wide == mesh.pip ? &context.plTerrainArrayWide : &context.plTerrainArray;
+	mesh.diffuse = layers;
+}
+
+TerrainPager::TerrainPager(Context& ctx, const int tileCount, const int tileSize, const vec2 min, const vec2 max, const int capacity, BuildFn build)
+	: _ctx(&ctx)
+	, _shared(std::make_shared<Shared>())
+	, _tileSize(tileSize)
+	, _min(min)
+	, _max(max)
+	, _slots(capacity)
+	, _slotOf(tileCount, -1)
+	, _wanted(tileCount, 0)
+	, _building(tileCount, false)
+{
+	_shared->build = std::move(build);
+}
+
+TerrainPager::~TerrainPager()
+{
+	{
+		// every build in flight ends up in ready exactly once, cancelled or not
+		std::unique_lock<std::mutex> lock(_shared->mutex);
+		_shared->cancelled = true;
+		_shared->done.wait(lock, [this] { return _shared->ready.size() == size_t(_inflight); });
+		_shared->ready.clear();
+	}
+	for (const Slot& slot : _slots) {
+		if (slot.mesh.vid.id != 0)
+			ReleaseMesh(*_ctx, slot.mesh);
+	}
+}
+
+void TerrainPager::update(const std::vector<int>& wanted)
+{
+	Context& ctx = *_ctx;
+	++_frame;
+
+	const size_t count = std::min(wanted.size(), _slots.size());
+	for (size_t n = 0; n < count; ++n) {
+		const int tile = wanted[n];
+		_wanted[tile] = _frame;
+		if (_slotOf[tile] >= 0) {
+			_slots[_slotOf[tile]].used = _frame;
+		} else if (!_building[tile] && _inflight < maxInflight) {
+			_building[tile] = true;
+			++_inflight;
+			ctx.jobs->run([shared = _shared, tile] {
+				bool cancelled;
+				{
+					std::lock_guard<std::mutex> lock(shared->mutex);
+					cancelled = shared->cancelled;
+				}
+				Built built{ tile, cancelled ? std::vector<TerrainVertex>{} : shared->build(tile) };
+				std::lock_guard<std::mutex> lock(shared->mutex);
+				shared->ready.push_back(std::move(built));
+				shared->done.notify_all();
+			});
+		}
+	}
+
+	std::deque<Built> ready;
+	{
+		std::lock_guard<std::mutex> lock(_shared->mutex);
+		ready.swap(_shared->ready);
+	}
+
+	const size_t size = size_t(_tileSize) * size_t(_tileSize);
+	int uploads = 0;
+	while (!ready.empty() && uploads < uploadsPerFrame) {
+		Built& built = ready.front();
+		// tiles the camera left while they were building are dropped
+		if (_wanted[built.tile] == _frame && built.vertice.size() == size) {
+			const int s = acquire();
+			if (s < 0)
+				break;
+
+			Slot& slot = _slots[s];
+			if (slot.tile >= 0)
+				_slotOf[slot.tile] = -1;
+			// every tile has the same size, so buffers are created once and then rewritten
+			if (slot.mesh.vid.id == 0) {
+				const sg_buffer vid = MakeBuffer(ctx, {
+					.size = size * sizeof(TerrainVertex),
+					.type = SG_BUFFERTYPE_VERTEXBUFFER,
+					.usage = SG_USAGE_DYNAMIC,
+				});
+				slot.mesh = MakeTerrain(ctx, vid, _tileSize, _tileSize, _min, _max, {});
+			}
+			sg_update_buffer(slot.mesh.vid, { built.vertice.data(), size * sizeof(TerrainVertex) });
+			slot.mesh.bounds = TerrainBounds(_min, _max, built.vertice);
+			slot.tile = built.tile;
+			slot.used = _frame;
+			_slotOf[built.tile] = s;
+			++uploads;
+		}
+		_building[built.tile] = false;
+		--_inflight;
+		ready.pop_front();
+	}
+
+	// whatever did not fit this frame goes back ahead of newer builds
+	if (!ready.empty()) {
+		std::lock_guard<std::mutex> lock(_shared->mutex);
+		_shared->ready.insert(_shared->ready.begin(), std::make_move_iterator(ready.begin()), std::make_move_iterator(ready.end()));
+	}
+}
+
+// a free slot, else the least recently used one not drawn this frame
+int TerrainPager::acquire() const
+{
+	int best = -1;
+	for (int s = 0; s < int(_slots.size()); ++s) {
+		if (_slots[s].tile < 0)
+			return s;
+		if (_slots[s].used < _frame && (best < 0 || _slots[s].used < _slots[best].used))
+			best = s;
+	}
+	return best;
+}
+
+const Mesh* TerrainPager::find(const int tile) const
+{
+	return _slotOf[tile] >= 0 ? &_slots[_slotOf[tile]].mesh : nullptr;
+}
+
+int TerrainPager::resident() const
+{
+	return int(std::count_if(_slots.begin(), _slots.end(), [] (const Slot& s) { return s.tile >= 0; }));
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+	: data(other.data)
+	, size(other.size)
+{
+	other.data = nullptr;
+	other.size = 0;
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+	std::swap(data, other.data);
+	std::swap(size, other.size);
+	return *this;
+}
+
+MappedFile::~MappedFile()
+{
+	if (data != nullptr)
+		munmap(const_cast<uint8_t*>(data), size);
+}
+
+std::optional<MappedFile> MapFile(std::string_view path)
+{
+	const int fd = open(std::string(path).c_str(), O_RDONLY);
+	if (fd < 0)
+		return {};
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return {};
+	}
+
+	void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return {};
+
+	madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+
+	MappedFile file;
+	file.data = static_cast<const uint8_t*>(ptr);
+	file.size = st.st_size;
+	return file;
+}
+
+namespace {
+
+enum class PlyType
+{
+	Invalid, Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64,
+};
+
+namespace ply {
+
+enum Cmp
+{
+	px, py, pz, nx, ny, nz, u, v, r, g, b, a, count, ignored = count,
+};
+
+}
+
+using PlyCmp = ply::Cmp;
+
+struct PlyProperty
+{
+	PlyType type{ PlyType::Invalid };
+	PlyType countType{ PlyType::Invalid };
+	int cmp{ ply::ignored };
+	int offset{ 0 };
+};
+
+struct PlyElement
+{
+	std::string_view name;
+	int count{ 0 };
+	std::vector<PlyProperty> props;
+	bool hasList{ false };
+	int stride{ 0 };
+};
+
+PlyType PlyTypeFromName(std::string_view name)
+{
+	static const std::map<std::string_view, PlyType> names = {
+		{ "char", PlyType::Int8 }, { "int8", PlyType::Int8 },
+		{ "uchar", PlyType::UInt8 }, { "uint8", PlyType::UInt8 },
+		{ "short", PlyType::Int16 }, { "int16", PlyType::Int16 },
+		{ "ushort", PlyType::UInt16 }, { "uint16", PlyType::UInt16 },
+		{ "int", PlyType::Int32 }, { "int32", PlyType::Int32 },
+		{ "uint", PlyType::UInt32 }, { "uint32", PlyType::UInt32 },
+		{ "float", PlyType::Float32 }, { "float32", PlyType::Float32 },
+		{ "double", PlyType::Float64 }, { "float64", PlyType::Float64 },
+	};
+	auto it = names.find(name);
+	return it != names.end() ? it->second : PlyType::Invalid;
+}
+
+int PlyTypeSize(PlyType type)
+{
+	switch (type) {
+	case PlyType::Int8: case PlyType::UInt8: return 1;
+	case PlyType::Int16: case PlyType::UInt16: return 2;
+	case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+	case PlyType::Float64: return 8;
+	default: return 0;
+	}
+}
+
+// integer color channels are stored normalized, positions, normals and uvs load as is
+float PlyNormScale(PlyType type, int cmp)
+{
+	if (cmp < ply::r || cmp > ply::a)
+		return 1.0f;
+	switch (type) {
+	case PlyType::UInt8: return 1.0f / 255.0f;
+	case PlyType::UInt16: return 1.0f / 65535.0f;
+	default: return 1.0f;
+	}
+}
+
+template <typename T>
+T PlyLoad(const uint8_t* ptr)
+{
+	T v;
+	memcpy(&v, ptr, sizeof(T));
+	return v;
+}
+
+double PlyReadBinary(PlyType type, const uint8_t* ptr)
+{
+	switch (type) {
+	case PlyType::Int8: return PlyLoad<int8_t>(ptr);
+	case PlyType::UInt8: return PlyLoad<uint8_t>(ptr);
+	case PlyType::Int16: return PlyLoad<int16_t>(ptr);
+	case PlyType::UInt16: return PlyLoad<uint16_t>(ptr);
+	case PlyType::Int32: return PlyLoad<int32_t>(ptr);
+	case PlyType::UInt32: return PlyLoad<uint32_t>(ptr);
+	case PlyType::Float32: return PlyLoad<float>(ptr);
+	case PlyType::Float64: return PlyLoad<double>(ptr);
+	default: return 0.0;
+	}
+}
+
+struct PlyCursor
+{
+	const char* cur;
+	const char* end;
+
+	std::string_view line()
+	{
+		const char* start = cur;
+		while (cur < end && *cur != '\n')
+			++cur;
+		std::string_view l(start, cur - start);
+		if (cur < end)
+			++cur;
+		if (!l.empty() && l.back() == '\r')
+			l.remove_suffix(1);
+		return l;
+	}
+
+	void skipLine()
+	{
+		const char* nl = static_cast<const char*>(memchr(cur, '\n', end - cur));
+		cur = nl ? nl + 1 : end;
+	}
+
+	void skipSpaces()
+	{
+		while (cur < end && uint8_t(*cur) <= ' ')
+			++cur;
+	}
+
+	template <typename T>
+	bool read(T& value)
+	{
+		skipSpaces();
+		auto [ptr, ec] = std::from_chars(cur, end, value);
+		if (ec != std::errc())
+			return false;
+		cur = ptr;
+		return true;
+	}
+};
+
+std::string_view PlyToken(std::string_view& line)
+{
+	const size_t start = line.find_first_not_of(" \t");
+	if (start == std::string_view::npos) {
+		line = {};
+		return {};
+	}
+	line.remove_prefix(start);
+	const size_t stop = line.find_first_of(" \t");
+	std::string_view token = line.substr(0, stop);
+	line.remove_prefix(stop == std::string_view::npos ? line.size() : stop);
+	return token;
+}
+
+void PlyPushVertex(std::vector<BaseVertex>& vertice, const std::array<float, ply::count>& data, bool hasColor)
+{
+	using namespace ply;
+	uint32_t color = 0xff00ff00;
+	if (hasColor) {
+		auto ch = [&] (int c) { return uint32_t(std::clamp(data[c], 0.0f, 1.0f) * 255.0f + 0.5f); };
+		color = ch(r) | (ch(g) << 8) | (ch(b) << 16) | (ch(a) << 24);
+	}
+	vertice.push_back({
+		{ data[px], data[py], data[pz] },
+		{ data[nx], data[ny], data[nz] },
+		{ data[u], data[v] },
+		color,
+	});
+}
+
+template <typename IDX>
+void PlyPushFace(std::vector<uint32_t>& indice, const IDX* idx, int n)
+{
+	// fan triangulation, polygons are expected to be convex
+	for (int k = 2; k < n; ++k) {
+		indice.push_back(idx[0]);
+		indice.push_back(idx[k - 1]);
+		indice.push_back(idx[k]);
+	}
+}
+
+}
+
+std::optional<MeshData> ParsePLY(std::string_view path)
+{
+	PIPO_ZONE("ParsePLY");
+	using namespace ply;
+
+	std::optional<MappedFile> file = MapFile(path);
+	if (!file)
+		return {};
+
+	const std::map<std::string_view, PlyCmp> idToCmp = {
+		{ "x", px },
+		{ "y", py },
+		{ "z", pz },
+		{ "nx", nx },
+		{ "ny", ny },
+		{ "nz", nz },
+		{ "u", u },
+		{ "v", v },
+		{ "s", u },
+		{ "t", v },
+		{ "texture_u", u },
+		{ "texture_v", v },
+		{ "red", r },
+		{ "green", g },
+		{ "blue", b },
+		{ "alpha", a },
+	};
+
+	PlyCursor in{ reinterpret_cast<const char*>(file->data), reinterpret_cast<const char*>(file->data + file->size) };
+
+	if (in.line() != "ply")
+		return {};
+
+	bool binary = false;
+	std::vector<PlyElement> format;
+
+	for (;;) {
+		if (in.cur >= in.end)
+			return {};
+		std::string_view line = in.line();
+		const std::string_view keyword = PlyToken(line);
+		if (keyword == "format") {
+			const std::string_view fmt = PlyToken(line);
+			if (fmt == "binary_little_endian")
+				binary = true;
+			else if (fmt != "ascii")
+				return {};
+		} else if (keyword == "element") {
+			PlyElement elt;
+			elt.name = PlyToken(line);
+			const std::string_view cnt = PlyToken(line);
+			if (std::from_chars(cnt.data(), cnt.data() + cnt.size(), elt.count).ec != std::errc())
+				return {};
+			format.push_back(elt);
+		} else if (keyword == "property") {
+			if (format.empty())
+				return {};
+			PlyElement& elt = format.back();
+			PlyProperty prop;
+			std::string_view fmt = PlyToken(line);
+			if (fmt == "list") {
+				prop.countType = PlyTypeFromName(PlyToken(line));
+				fmt = PlyToken(line);
+				elt.hasList = true;
+				if (prop.countType == PlyType::Invalid)
+					return {};
+			}
+			prop.type = PlyTypeFromName(fmt);
+			if (prop.type == PlyType::Invalid)
+				return {};
+			auto itf = idToCmp.find(PlyToken(line));
+			if (itf != idToCmp.end() && prop.countType == PlyType::Invalid)
+				prop.cmp = itf->second;
+			prop.offset = elt.stride;
+			elt.stride += PlyTypeSize(prop.type);
+			elt.props.push_back(prop);
+		} else if (keyword == "end_header") {
+			break;
+		}
+	}
+
+	MeshData mesh;
+	std::vector<uint32_t> face;
+
+	for (const PlyElement& elt : format) {
+		if (elt.name == "vertex") {
+			if (elt.hasList)
+				return {};
+
+			bool hasColor = false;
+			bool hasNormals = false;
+			for (const PlyProperty& prop : elt.props) {
+				hasColor |= (prop.cmp >= r && prop.cmp <= a);
+				hasNormals |= (prop.cmp >= nx && prop.cmp <= nz);
+			}
+			mesh.hasNormals = hasNormals;
+
+			mesh.vertice.reserve(elt.count);
+			std::array<float, count> defaults;
+			std::fill(defaults.begin(), defaults.end(), 0.5f);
+			defaults[a] = 1.0f;
+			std::array<float, count> data;
+
+			if (binary) {
+				const uint8_t* base = reinterpret_cast<const uint8_t*>(in.cur);
+				if (size_t(in.end - in.cur) < size_t(elt.count) * elt.stride)
+					return {};
+				for (int i = 0; i < elt.count; ++i, base += elt.stride) {
+					data = defaults;
+					for (const PlyProperty& prop : elt.props) {
+						if (prop.cmp == ignored)
+							continue;
+						if (prop.type == PlyType::Float32)
+							data[prop.cmp] = PlyLoad<float>(base + prop.offset);
+						else
+							data[prop.cmp] = float(PlyReadBinary(prop.type, base + prop.offset)) * PlyNormScale(prop.type, prop.cmp);
+					}
+					PlyPushVertex(mesh.vertice, data, hasColor);
+				}
+				in.cur = reinterpret_cast<const char*>(base);
+			} else {
+				for (int i = 0; i < elt.count; ++i) {
+					data = defaults;
+					for (const PlyProperty& prop : elt.props) {
+						float value;
+						if (!in.read(value))
+							return {};
+						if (prop.cmp != ignored)
+							data[prop.cmp] = value * PlyNormScale(prop.type, prop.cmp);
+					}
+					PlyPushVertex(mesh.vertice, data, hasColor);
+				}
+			}
+		} else if (elt.name == "face") {
+			mesh.indice.reserve(3 * elt.count);
+			for (int i = 0; i < elt.count; ++i) {
+				for (const PlyProperty& prop : elt.props) {
+					const bool isList = prop.countType != PlyType::Invalid;
+					if (binary) {
+						const uint8_t* ptr = reinterpret_cast<const uint8_t*>(in.cur);
+						const uint8_t* end = reinterpret_cast<const uint8_t*>(in.end);
+						int n = 1;
+						if (isList) {
+							if (end - ptr < PlyTypeSize(prop.countType))
+								return {};
+							n = int(PlyReadBinary(prop.countType, ptr));
+							ptr += PlyTypeSize(prop.countType);
+						}
+						const int sz = PlyTypeSize(prop.type);
+						if (n < 0 || end - ptr < ptrdiff_t(n) * sz)
+							return {};
+						if (isList) {
+							face.resize(n);
+							for (int k = 0; k < n; ++k)
+								face[k] = uint32_t(PlyReadBinary(prop.type, ptr + k * sz));
+							PlyPushFace(mesh.indice, face.data(), n);
+						}
+						in.cur = reinterpret_cast<const char*>(ptr + ptrdiff_t(n) * sz);
+					} else if (isList) {
+						int n;
+						if (!in.read(n) || n < 0)
+							return {};
+						face.resize(n);
+						for (int k = 0; k < n; ++k) {
+							if (!in.read(face[k]))
+								return {};
+						}
+						PlyPushFace(mesh.indice, face.data(), n);
+					} else {
+						double dummy;
+						if (!in.read(dummy))
+							return {};
+					}
+				}
+			}
+		} else if (binary && !elt.hasList) {
+			in.cur += size_t(elt.count) * elt.stride;
+		} else if (binary) {
+			// unknown variable-size element, nothing after it can be located
+			break;
+		} else {
+			for (int i = 0; i < elt.count; ++i)
+				in.skipLine();
+		}
+		if (in.cur > in.end)
+			return {};
+	}
+
+	if (mesh.vertice.empty() || mesh.indice.empty())
+		return {};
+	if (*std::max_element(mesh.indice.begin(), mesh.indice.end()) >= mesh.vertice.size())
+		return {};
+
+	return mesh;
+}
+
+std::optional<Mesh> LoadMesh(Context& context, std::string_view path)
+{
+	PIPO_ZONE("LoadMesh");
+	std::optional<MeshData> data = ParsePLY(path);
+	if (!data)
+		return {};
+
+	if (!data->hasNormals)
+		ComputeNormals(*data, context.jobs.get());
+	OptimizeMesh(*data);
+	return MakeMesh(context, PackVertices(data->vertice), data->indice);
+}
+
+std::vector<Mesh> LoadSubmeshes(Context& context, std::string_view path)
+{
+	PIPO_ZONE("LoadSubmeshes");
+	std::optional<MeshData> data = ParsePLY(path);
+	if (!data)
+		return {};
+
+	if (!data->hasNormals)
+		ComputeNormals(*data, context.jobs.get());
+	std::vector<Mesh> meshes;
+	for (MeshData& part : SplitMesh(*data)) {
+		OptimizeMesh(part);
+		meshes.push_back(MakeMesh(context, PackVertices(part.vertice), part.indice));
+	}
+	return meshes;
+}
+
+std::optional<Pack> OpenPack(std::string_view path)
+{
+	PIPO_ZONE("OpenPack");
+	std::optional<MappedFile> file = MapFile(path);
+	if (!file || file->size < sizeof(PackHeader))
+		return {};
+
+	const PackHeader* header = reinterpret_cast<const PackHeader*>(file->data);
+	if (header->magic != PackMagic || header->version != PackVersion)
+		return {};
+	if (file->size < sizeof(PackHeader) + size_t(header->count) * sizeof(PackEntry))
+		return {};
+
+	Pack pack;
+	pack.entries = reinterpret_cast<const PackEntry*>(file->data + sizeof(PackHeader));
+	pack.count = header->count;
+	for (uint32_t i = 0; i < pack.count; ++i) {
+		const PackEntry& entry = pack.entries[i];
+		if (entry.offset % PackAlign != 0 || entry.offset > file->size || entry.size > file->size - entry.offset)
+			return {};
+	}
+	pack.file = std::move(*file);
+	return pack;
+}
+
+const PackEntry* Pack::find(std::string_view name, PackEntryType type) const
+{
+	for (uint32_t i = 0; i < count; ++i) {
+		const PackEntry& entry = entries[i];
+		if (entry.type == type && name == std::string_view(entry.name.data(), strnlen(entry.name.data(), entry.name.size())))
+			return &entry;
+	}
+	return nullptr;
+}
+
+std::optional<Mesh> LoadMesh(Context& context, const Pack& pack, std::string_view name)
+{
+	PIPO_ZONE("LoadMesh");
+	const PackEntry* entry = pack.find(name, PackEntryType::Mesh);
+	if (!entry)
+		return {};
+
+	const PackMesh* mesh = pack.get<PackMesh>(*entry);
+	if (!mesh
+		|| !pack.contains(*entry, mesh->vertexOffset, mesh->vertexCount * sizeof(PackedVertex))
+		|| (mesh->indexSize != sizeof(uint16_t) && mesh->indexSize != sizeof(uint32_t))
+		|| !pack.contains(*entry, mesh->indexOffset, size_t(mesh->indexCount) * mesh->indexSize)
+		|| (mesh->tangentOffset != 0 && !pack.contains(*entry, mesh->tangentOffset, mesh->vertexCount * sizeof(std::array<int16_t, 4>))))
+		return {};
+	const sg_buffer vid = MakeBuffer(context, {
+		.type = SG_BUFFERTYPE_VERTEXBUFFER,
+		.data = { pack.data(*entry, mesh->vertexOffset), mesh->vertexCount * sizeof(PackedVertex) },
+	});
+	const sg_buffer iid = MakeBuffer(context, {
+		.type = SG_BUFFERTYPE_INDEXBUFFER,
+		.data = { pack.data(*entry, mesh->indexOffset), size_t(mesh->indexCount) * mesh->indexSize },
+	});
+
+	Mesh msh = MakeMesh(context, vid, std::pair<sg_buffer, int>{ iid, mesh->indexCount });
+	msh.pip = mesh->indexSize == sizeof(uint32_t) ? &context.plPackedWide : &context.plPacked;
+	msh.bounds = mesh->bounds;
+	ReleaseBuffer(context, vid);
+	ReleaseBuffer(context, iid);
+	return msh;
+}
+
+std::optional<Texture> LoadTexture(Context& context, const Pack& pack, std::string_view name)
+{
+	PIPO_ZONE("LoadTexture");
+	const PackEntry* entry = pack.find(name, PackEntryType::Texture);
+	if (!entry)
+		return {};
+
+	const PackTexture* tex = pack.get<PackTexture>(*entry);
+	if (!tex || tex->mips == 0 || tex->mips > SG_MAX_MIPMAPS || tex->slices == 0)
+		return {};
+	for (uint32_t i = 0; i < tex->mips; ++i) {
+		if (!pack.contains(*entry, tex->mipOffset[i], tex->mipSize[i]))
+			return {};
+	}
+
+	const sg_image_type type = tex->slices > 1 ? SG_IMAGETYPE_ARRAY : SG_IMAGETYPE_2D;
+	sg_image_desc img_desc {
+		.type = type,
+		.width = int(tex->width),
+		.height = int(tex->height),
+		.num_slices = int(tex->slices),
+		.num_mipmaps = int(tex->mips),
+		.pixel_format = sg_pixel_format(tex->pixelFormat),
+		.max_anisotropy = 4,
+	};
+
+	for (uint32_t i = 0; i < tex->mips; ++i) {
+		img_desc.data.subimage[0][i] = {
+			.ptr = pack.data(*entry, tex->mipOffset[i]),
+			.size = tex->mipSize[i],
+		};
+	}
+
+	return Texture{ MakeImage(context, img_desc), type };
+}
+
+std::optional<Mesh> LoadHMap(Context& context, const Pack& pack, std::string_view name)
+{
+	PIPO_ZONE("LoadHMap");
+	const PackEntry* entry = pack.find(name, PackEntryType::HMapTile);
+	if (!entry)
+		return {};
+
+	const PackHMapTile* tile = pack.get<PackHMapTile>(*entry);
+	if (!tile || tile->w <= 0 || tile->h <= 0 || !pack.contains(*entry, tile->vertexOffset, size_t(tile->w * tile->h) * sizeof(TerrainVertex)))
+		return {};
+	const sg_buffer vid = MakeBuffer(context, {
+		.type = SG_BUFFERTYPE_VERTEXBUFFER,
+		.data = { pack.data(*entry, tile->vertexOffset), size_t(tile->w * tile->h) * sizeof(TerrainVertex) },
+	});
+
+	return MakeTerrain(context, vid, tile->w, tile->h, tile->min, tile->max, tile->bounds);
+}
+
+namespace {
+
+void ApplyPipeline(Context& ctx, Pipeline& pip)
+{
+	if (ctx.lastPip.id == pip.pl.id) {
+		++ctx.stats.pipelineSkipped;
+		return;
+	}
+	ctx.lastPip = pip.pl;
+	// a new pipeline drops the bound resources and uniforms
+	ctx.lastBindings = {};
+	sg_apply_pipeline(pip.pl);
+	pip.frame(ctx);
+	++ctx.stats.pipelineChanges;
+}
+
+void ApplyBindings(Context& ctx, const sg_bindings& bd)
+{
+	if (memcmp(&ctx.lastBindings, &bd, sizeof(sg_bindings)) == 0) {
+		++ctx.stats.bindingSkipped;
+		return;
+	}
+	ctx.lastBindings = bd;
+	sg_apply_bindings(&bd);
+	++ctx.stats.bindingChanges;
+}
+
+// textures still streaming in are drawn with a white texture of the kind the pipeline samples
+sg_image ResolveTexture(const Context& ctx, const Pipeline& pip, const Texture& tex)
+{
+	if (sg_query_image_state(tex.iid) == SG_RESOURCESTATE_VALID)
+		return tex.iid;
+	return pip.imageType == SG_IMAGETYPE_ARRAY ? ctx.txWhiteArray.iid : ctx.txWhite.iid;
+}
+
+void SubmitMesh(Context& ctx, const Mesh& mesh, const Transform& t)
+{
+	ApplyPipeline(ctx, *mesh.pip);
+
+	const sg_bindings bd = {
+		.vertex_buffers = { mesh.vid, mesh.grid },
+		.index_buffer = mesh.iid,
+		.fs_images = { ResolveTexture(ctx, *mesh.pip, mesh.diffuse) },
+	};
+
+	ApplyBindings(ctx, bd);
+
+	mesh.pip->draw(t);
+
+	sg_draw(0, mesh.pcount, 1);
+	++ctx.stats.draws;
+	ctx.stats.triangles += mesh.pcount / 3;
+}
+
+void SubmitMeshInstanced(Context& ctx, const Mesh& mesh, const Transform* transforms, int count)
+{
+	Pipeline* pip = mesh.pip->instanced;
+	const int room = ctx.instanceCapacity - ctx.instanceCount;
+	if (pip == nullptr || room <= 0) {
+		for (int i = 0; i < count; ++i)
+			SubmitMesh(ctx, mesh, transforms[i]);
+		return;
+	}
+
+	ApplyPipeline(ctx, *pip);
+
+	const int n = std::min(count, room);
+	const int offset = sg_append_buffer(ctx.instanceBuffer, { transforms, n * sizeof(Transform) });
+	ctx.instanceCount += n;
+
+	const sg_bindings bd = {
+		.vertex_buffers = { mesh.vid, ctx.instanceBuffer },
+		.vertex_buffer_offsets = { 0, offset },
+		.index_buffer = mesh.iid,
+		.fs_images = { ResolveTexture(ctx, *pip, mesh.diffuse) },
+	};
+
+	ApplyBindings(ctx, bd);
+
+	sg_draw(0, mesh.pcount, n);
+	++ctx.stats.draws;
+	ctx.stats.triangles += n * (mesh.pcount / 3);
+
+	// whatever did not fit in this frame's instance buffer is drawn one by one
+	for (int i = n; i < count; ++i)
+		SubmitMesh(ctx, mesh, transforms[i]);
+}
+
+// positive floats order like their bit patterns, the top 16 bits give a log-scaled depth
+uint64_t QuantizeDepth(float depth)
+{
+	depth = std::max(depth, 0.0f);
+	uint32_t bits;
+	memcpy(&bits, &depth, sizeof(bits));
+	return bits >> 15;
+}
+
+// sokol ids keep the pool slot in their low 16 bits
+uint64_t SlotBits(uint32_t id, int bits)
+{
+	return id & ((1u << bits) - 1);
+}
+
+void EnqueueMesh(Context& ctx, const Mesh& mesh, const Transform* transforms, int count, bool instanced)
+{
+	RenderQueue& queue = ctx.queue;
+
+	// view depth of the first instance origin, enough to order opaque draws front to back
+	const mat4& world = transforms[0].world;
+	const vec4 origin = ctx.view * HMM_Vec4(world.Elements[3][0], world.Elements[3][1], world.Elements[3][2], 1.0f);
+	const Pipeline* pip = instanced && mesh.pip->instanced ? mesh.pip->instanced : mesh.pip;
+
+	DrawPacket packet;
+	packet.key =
+		(SlotBits(pip->pl.id, 8) << 56) |
+		(SlotBits(mesh.diffuse.iid.id, 12) << 44) |
+		(QuantizeDepth(-origin.Z) << 28) |
+		(SlotBits(mesh.vid.id, 16) << 12) |
+		SlotBits(mesh.iid.id, 12);
+	packet.mesh = mesh;
+	packet.first = int(queue.transforms.size());
+	packet.count = count;
+	packet.instanced = instanced;
+
+	queue.transforms.insert(queue.transforms.end(), transforms, transforms + count);
+	queue.packets.push_back(packet);
+}
+
+// LSD radix sort over 8-bit digits, digits shared by every key are skipped
+void RadixSort(std::vector<RenderQueue::SortItem>& items, std::vector<RenderQueue::SortItem>& scratch)
+{
+	scratch.resize(items.size());
+	for (int shift = 0; shift < 64; shift += 8) {
+		std::array<uint32_t, 257> offsets{};
+		for (const auto& item : items)
+			++offsets[((item.key >> shift) & 0xff) + 1];
+		if (std::find(offsets.begin() + 1, offsets.end(), uint32_t(items.size())) != offsets.end())
+			continue;
+		for (int i = 1; i < 257; ++i)
+			offsets[i] += offsets[i - 1];
+		for (const auto& item : items)
+			scratch[offsets[(item.key >> shift) & 0xff]++] = item;
+		items.swap(scratch);
+	}
+}
+
+}
+
+void FlushRenderQueue(Context& ctx)
+{
+	PIPO_ZONE("FlushRenderQueue");
+	RenderQueue& queue = ctx.queue;
+	queue.active = false;
+
+	queue.order.clear();
+	queue.order.reserve(queue.packets.size());
+	for (uint32_t i = 0; i < queue.packets.size(); ++i)
+		queue.order.push_back({ queue.packets[i].key, i });
+
+	RadixSort(queue.order, queue.scratch);
+
+	for (const auto& item : queue.order) {
+		const DrawPacket& packet = queue.packets[item.index];
+		const Transform* transforms = &queue.transforms[packet.first];
+		if (packet.instanced)
+			SubmitMeshInstanced(ctx, packet.mesh, transforms, packet.count);
+		else
+			SubmitMesh(ctx, packet.mesh, *transforms);
+	}
+	ctx.stats.packets += int(queue.packets.size());
+
+	queue.packets.clear();
+	queue.transforms.clear();
+}
+
+void DrawMesh(Context& ctx, const Mesh& mesh, const Transform& t)
+{
+	PIPO_ZONE("DrawMesh");
+	if (mesh.pcount <= 0)
+		return;
+
+	if (ctx.cullEnabled && mesh.bounds.valid() && TestBounds(ctx.frustum, TransformBounds(mesh.bounds, t.world)) == Visibility::Outside) {
+		++ctx.stats.culled;
+		return;
+	}
+
+	if (ctx.queue.active)
+		EnqueueMesh(ctx, mesh, &t, 1, false);
+	else
+		SubmitMesh(ctx, mesh, t);
+}
+
+void DrawMeshInstanced(Context& ctx, const Mesh& mesh, const Transform* transforms, int count)
+{
+	PIPO_ZONE("DrawMeshInstanced");
+	if (mesh.pcount <= 0 || count <= 0)
+		return;
+
+	if (ctx.cullEnabled && mesh.bounds.valid()) {
+		std::vector<Transform>& visible = ctx.cullScratch;
+		visible.clear();
+		for (int i = 0; i < count; ++i) {
+			if (TestBounds(ctx.frustum, TransformBounds(mesh.bounds, transforms[i].world)) != Visibility::Outside)
+				visible.push_back(transforms[i]);
+		}
+		ctx.stats.culled += count - int(visible.size());
+		if (visible.empty())
+			return;
+		transforms = visible.data();
+		count = int(visible.size());
+	}
+
+	if (ctx.queue.active)
+		EnqueueMesh(ctx, mesh, transforms, count, true);
+	else
+		SubmitMeshInstanced(ctx, mesh, transforms, count);
+}
+
+void DrawMeshInstanced(Context& ctx, const Mesh& mesh, const std::vector<Transform>& transforms)
+{
+	DrawMeshInstanced(ctx, mesh, transforms.data(), int(transforms.size()));
+}
+
+sg_pixel_format DDSPixelFormat(tinyddsloader::DDSFile::DXGIFormat format)
+{
+	using DXGI = tinyddsloader::DDSFile::DXGIFormat;
+	switch (format) {
+	case DXGI::BC1_UNorm:
+	case DXGI::BC1_UNorm_SRGB:
+		return SG_PIXELFORMAT_BC1_RGBA;
+	case DXGI::BC2_UNorm:
+	case DXGI::BC2_UNorm_SRGB:
+		return SG_PIXELFORMAT_BC2_RGBA;
+	case DXGI::BC3_UNorm:
+	case DXGI::BC3_UNorm_SRGB:
+		return SG_PIXELFORMAT_BC3_RGBA;
+	case DXGI::BC4_UNorm:
+		return SG_PIXELFORMAT_BC4_R;
+	case DXGI::BC4_SNorm:
+		return SG_PIXELFORMAT_BC4_RSN;
+	case DXGI::BC5_UNorm:
+		return SG_PIXELFORMAT_BC5_RG;
+	case DXGI::BC5_SNorm:
+		return SG_PIXELFORMAT_BC5_RGSN;
+	case DXGI::BC6H_UF16:
+		return SG_PIXELFORMAT_BC6H_RGBUF;
+	case DXGI::BC6H_SF16:
+		return SG_PIXELFORMAT_BC6H_RGBF;
+	case DXGI::BC7_UNorm:
+	case DXGI::BC7_UNorm_SRGB:
+		return SG_PIXELFORMAT_BC7_RGBA;
+	case DXGI::R8G8B8A8_UNorm:
+	case DXGI::R8G8B8A8_UNorm_SRGB:
+		return SG_PIXELFORMAT_RGBA8;
+	case DXGI::B8G8R8A8_UNorm:
+		return SG_PIXELFORMAT_BGRA8;
+	case DXGI::R8_UNorm:
+		return SG_PIXELFORMAT_R8;
+	case DXGI::R8G8_UNorm:
+		return SG_PIXELFORMAT_RG8;
+	case DXGI::R16_UNorm:
+		return SG_PIXELFORMAT_R16;
+	case DXGI::R16_Float:
+		return SG_PIXELFORMAT_R16F;
+	case DXGI::R16G16_Float:
+		return SG_PIXELFORMAT_RG16F;
+	case DXGI::R16G16B16A16_UNorm:
+		return SG_PIXELFORMAT_RGBA16;
+	case DXGI::R16G16B16A16_Float:
+		return SG_PIXELFORMAT_RGBA16F;
+	case DXGI::R32_Float:
+		return SG_PIXELFORMAT_R32F;
+	case DXGI::R32G32_Float:
+		return SG_PIXELFORMAT_RG32F;
+	case DXGI::R32G32B32A32_Float:
+		return SG_PIXELFORMAT_RGBA32F;
+	case DXGI::R10G10B10A2_UNorm:
+		return SG_PIXELFORMAT_RGB10A2;
+	default:
+		return SG_PIXELFORMAT_NONE;
+	}
+}
+
+Texture MakeTextureRGBA(Context& ctx, int w, int h, const std::vector<uint32_t>& data)
+{
+	auto iid = MakeImage(ctx, {
+		.width = w,
+		.height = h,
+		.data = {
+			.subimage = {
+				{ { &data[0], w * h * 4u } }
+			}
+		}
+	});
+	return { iid };
+}
+
+namespace {
+
+// slices come from the items, or from the array of a single item
+// array picks the image type up front so it matches what the caller was handed
+PendingTexture DecodeDDS(const std::vector<std::string>& items, const bool array)
+{
+	PIPO_ZONE("DecodeDDS");
+	PendingTexture tex;
+	std::vector<tinyddsloader::DDSFile> dds(items.size());
+	for (size_t i = 0; i < items.size(); ++i) {
+		if (dds[i].Load(items[i].c_str()) != tinyddsloader::Result::Success)
+			return tex;
+	}
+	if (dds.empty() || dds[0].IsCubemap() || dds[0].GetTextureDimension() != tinyddsloader::DDSFile::TextureDimension::Texture2D)
+		return tex;
+
+	tex.width = dds[0].GetWidth();
+	tex.height = dds[0].GetHeight();
+	tex.mips = std::min<int>(dds[0].GetMipCount(), SG_MAX_MIPMAPS);
+	tex.format = DDSPixelFormat(dds[0].GetFormat());
+	tex.slices = dds.size() > 1 ? int(dds.size()) : int(dds[0].GetArraySize());
+	tex.type = array ? SG_IMAGETYPE_ARRAY : SG_IMAGETYPE_2D;
+	if (tex.format == SG_PIXELFORMAT_NONE || (!array && tex.slices != 1))
+		return tex;
+	for (const tinyddsloader::DDSFile& d : dds) {
+		if (d.GetWidth() != dds[0].GetWidth() || d.GetHeight() != dds[0].GetHeight() || d.GetMipCount() != dds[0].GetMipCount() || d.GetFormat() != dds[0].GetFormat())
+			return tex;
+	}
+
+	// sokol wants every slice of a mip in one block
+	for (int i = 0; i < tex.mips; ++i) {
+		tex.mipOffset[i] = tex.data.size();
+		for (int s = 0; s < tex.slices; ++s) {
+			const tinyddsloader::DDSFile::ImageData* data = dds.size() > 1 ? dds[s].GetImageData(i) : dds[0].GetImageData(i, s);
+			const uint8_t* mem = static_cast<const uint8_t*>(data->m_mem);
+			tex.data.insert(tex.data.end(), mem, mem + data->m_memSlicePitch);
+		}
+		tex.mipSize[i] = tex.data.size() - tex.mipOffset[i];
+	}
+	tex.ok = tex.width > 0 && tex.height > 0 && tex.mips > 0 && tex.slices > 0;
+	return tex;
+}
+
+sg_image_desc PendingImageDesc(const PendingTexture& tex)
+{
+	sg_image_desc img_desc {
+		.type = tex.type,
+		.width = tex.width,
+		.height = tex.height,
+		.num_slices = tex.slices,
+		.num_mipmaps = tex.mips,
+		.pixel_format = tex.format,
+		.max_anisotropy = 4,
+	};
+
+	for (int i = 0; i < tex.mips; ++i) {
+		img_desc.data.subimage[0][i] = {
+			.ptr = tex.data.data() + tex.mipOffset[i],
+			.size = tex.mipSize[i],
+		};
+	}
+	return img_desc;
+}
+
+// decoding runs on workers, only the render thread may ask the backend
+bool CanUpload(const PendingTexture& tex)
+{
+	return tex.ok && sg_query_pixelformat(tex.format).sample && (tex.type != SG_IMAGETYPE_ARRAY || sg_query_features().imagetype_array);
+}
+
+// registered without bytes, UploadTextures accounts for them
+sg_image AllocImage(Context& ctx)
+{
+	const sg_image image = sg_alloc_image();
+	ResourceRegistry::Entry& entry = ctx.resources.images[image.id];
+	entry.kind = ResourceKind::Texture;
+	entry.refs = 1;
+	return image;
+}
+
+void QueueTexture(Context& ctx, PendingTexture&& tex)
+{
+	TextureStream& stream = *ctx.textures;
+	std::lock_guard<std::mutex> lock(stream.mutex);
+	stream.ready.push_back(std::move(tex));
+	--stream.inflight;
+}
+
+}
+
+std::optional<Texture> LoadDDS(Context& ctx, const std::vector<std::string>& arrayItems)
+{
+	PIPO_ZONE("LoadDDS");
+	if (arrayItems.empty())
+		return {};
+
+	const PendingTexture tex = DecodeDDS(arrayItems, true);
+	if (!CanUpload(tex))
+		return {};
+
+	const sg_image_desc img_desc = PendingImageDesc(tex);
+	return Texture{ MakeImage(ctx, img_desc), SG_IMAGETYPE_ARRAY };
+}
+
+namespace {
+
+Texture DecodeDDSAsync(Context& ctx, const std::vector<std::string>& items, const bool array)
+{
+	const sg_image image = AllocImage(ctx);
+	{
+		std::lock_guard<std::mutex> lock(ctx.textures->mutex);
+		++ctx.textures->inflight;
+	}
+	ctx.jobs->run([&ctx, image, items, array] {
+		PendingTexture tex = DecodeDDS(items, array);
+		tex.image = image;
+		QueueTexture(ctx, std::move(tex));
+	});
+	return { image, array ? SG_IMAGETYPE_ARRAY : SG_IMAGETYPE_2D };
+}
+
+}
+
+Texture LoadTextureAsync(Context& ctx, const std::string& path)
+{
+	return DecodeDDSAsync(ctx, { path }, false);
+}
+
+Texture LoadTextureAsync(Context& ctx, const std::vector<std::string>& arrayItems)
+{
+	return DecodeDDSAsync(ctx, arrayItems, true);
+}
+
+std::optional<Texture> LoadTextureAsync(Context& ctx, const Pack& pack, std::string_view name)
+{
+	const PackEntry* entry = pack.find(name, PackEntryType::Texture);
+	if (!entry)
+		return {};
+
+	const PackTexture* header = pack.get<PackTexture>(*entry);
+	const sg_image_type type = header && header->slices > 1 ? SG_IMAGETYPE_ARRAY : SG_IMAGETYPE_2D;
+	const sg_image image = AllocImage(ctx);
+	{
+		std::lock_guard<std::mutex> lock(ctx.textures->mutex);
+		++ctx.textures->inflight;
+	}
+	// the copy out of the mapping is where the pages get read, so it stays on the worker
+	ctx.jobs->run([&ctx, &pack, entry, image, header, type] {
+		PIPO_ZONE("LoadTextureAsync");
+		PendingTexture tex;
+		tex.image = image;
+		if (header && header->mips > 0 && header->mips <= SG_MAX_MIPMAPS && header->slices > 0) {
+			tex.ok = true;
+			tex.width = int(header->width);
+			tex.height = int(header->height);
+			tex.mips = int(header->mips);
+			tex.slices = int(header->slices);
+			tex.type = type;
+			tex.format = sg_pixel_format(header->pixelFormat);
+			for (int i = 0; i < tex.mips; ++i) {
+				if (!pack.contains(*entry, header->mipOffset[i], header->mipSize[i])) {
+					tex.ok = false;
+					break;
+				}
+				const uint8_t* mem = static_cast<const uint8_t*>(pack.data(*entry, header->mipOffset[i]));
+				tex.mipOffset[i] = tex.data.size();
+				tex.mipSize[i] = header->mipSize[i];
+				tex.data.insert(tex.data.end(), mem, mem + header->mipSize[i]);
+			}
+		}
+		QueueTexture(ctx, std::move(tex));
+	});
+	return Texture{ image, type };
+}
+
+int UploadTextures(Context& ctx)
+{
+	PIPO_ZONE("UploadTextures");
+	TextureStream& stream = *ctx.textures;
+
+	int count = 0;
+	size_t bytes = 0;
+	for (;;) {
+		PendingTexture tex;
+		{
+			std::lock_guard<std::mutex> lock(stream.mutex);
+			if (stream.ready.empty() || (count > 0 && bytes + stream.ready.front().data.size() > stream.budget))
+				break;
+			tex = std::move(stream.ready.front());
+			stream.ready.pop_front();
+		}
+
+		// released before it arrived, the handle is already gone
+		auto entry = ctx.resources.images.find(tex.image.id);
+		if (entry == ctx.resources.images.end())
+			continue;
+
+		// failed loads keep drawing with txWhite
+		if (CanUpload(tex)) {
+			const sg_image_desc img_desc = PendingImageDesc(tex);
+			sg_init_image(tex.image, &img_desc);
+			entry->second.bytes = tex.data.size();
+			ctx.resources.bytes[size_t(ResourceKind::Texture)] += tex.data.size();
+		} else {
+			sg_fail_image(tex.image);
+		}
+		bytes += tex.data.size();
+		++count;
+	}
+
+	ctx.stats.textureUploads += count;
+	ctx.stats.textureBytes += bytes;
+	return count;
+}
+
+int PendingTextures(Context& ctx)
+{
+	std::lock_guard<std::mutex> lock(ctx.textures->mutex);
+	return ctx.textures->inflight + int(ctx.textures->ready.size());
+}
+
+namespace {
+
+// big-endian 16-bit samples, n contiguous
+void PPMRow16(const uint8_t* src, int n, float scale, float bias, float* out)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 vscale = _mm_set1_ps(scale);
+	const __m128 vbias = _mm_set1_ps(bias);
+	for (; x + 8 <= n; x += 8) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * x));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		const __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+		const __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+		_mm_storeu_ps(out + x, _mm_add_ps(_mm_mul_ps(lo, vscale), vbias));
+		_mm_storeu_ps(out + x + 4, _mm_add_ps(_mm_mul_ps(hi, vscale), vbias));
+	}
+#endif
+	for (; x < n; ++x)
+		out[x] = float((src[2 * x] << 8) | src[2 * x + 1]) * scale + bias;
+}
+
+void PPMRow8(const uint8_t* src, int n, float scale, float bias, float* out)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 vscale = _mm_set1_ps(scale);
+	const __m128 vbias = _mm_set1_ps(bias);
+	for (; x + 16 <= n; x += 16) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+		const __m128i lo = _mm_unpacklo_epi8(v, zero);
+		const __m128i hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_ps(out + x, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), vscale), vbias));
+		_mm_storeu_ps(out + x + 4, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), vscale), vbias));
+		_mm_storeu_ps(out + x + 8, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), vscale), vbias));
+		_mm_storeu_ps(out + x + 12, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), vscale), vbias));
+	}
+#endif
+	for (; x < n; ++x)
+		out[x] = float(src[x]) * scale + bias;
+}
+
+// header fields are separated by whitespace and may be interleaved with # comments
+bool PPMField(const uint8_t* data, size_t size, size_t& offset, int& value)
+{
+	for (;;) {
+		while (offset < size && std::isspace(data[offset]))
+			++offset;
+		if (offset >= size || data[offset] != '#')
+			break;
+		while (offset < size && data[offset] != '\n')
+			++offset;
+	}
+	const char* first = reinterpret_cast<const char*>(data + offset);
+	const char* last = reinterpret_cast<const char*>(data + size);
+	const std::from_chars_result res = std::from_chars(first, last, value);
+	if (res.ec != std::errc() || res.ptr == first)
+		return false;
+	offset += res.ptr - first;
+	return true;
+}
+
+}
+
+std::optional<PPMInfo> ParsePPMHeader(const uint8_t* data, size_t size)
+{
+	if (size < 2 || data[0] != 'P' || (data[1] != '5' && data[1] != '6'))
+		return {};
+
+	PPMInfo info;
+	info.channels = data[1] == '6' ? 3 : 1;
+	size_t offset = 2;
+	if (!PPMField(data, size, offset, info.width) || !PPMField(data, size, offset, info.height) || !PPMField(data, size, offset, info.maxval))
+		return {};
+	// exactly one whitespace byte before the samples
+	if (offset >= size || !std::isspace(data[offset]))
+		return {};
+	info.dataOffset = offset + 1;
+
+	if (info.width <= 0 || info.height <= 0 || info.maxval <= 0 || info.maxval > 0xffff)
+		return {};
+	const size_t bytes = size_t(info.width) * size_t(info.height) * size_t(info.channels) * (info.maxval > 0xff ? 2 : 1);
+	if (size - info.dataOffset < bytes)
+		return {};
+	return info;
+}
+
+std::optional<PPMInfo> LoadPPM(std::string_view path, std::vector<float>& dst, const float scale, const float bias, const int channel, JobSystem* jobs)
+{
+	PIPO_ZONE("LoadPPM");
+	const std::optional<MappedFile> file = MapFile(path);
+	if (!file)
+		return {};
+	const std::optional<PPMInfo> info = ParsePPMHeader(file->data, file->size);
+	if (!info || channel < 0 || channel >= info->channels)
+		return {};
+
+	const int w = info->width;
+	const int sampleSize = info->maxval > 0xff ? 2 : 1;
+	const size_t pitch = size_t(w) * info->channels * sampleSize;
+	const uint8_t* samples = file->data + info->dataOffset;
+	const float rscale = scale / float(info->maxval);
+	dst.resize(size_t(w) * info->height);
+
+	// rgb rows are first gathered into one contiguous channel
+	auto convert = [&] (int y, std::vector<uint8_t>& gather) {
+		const uint8_t* src = samples + y * pitch;
+		if (info->channels > 1) {
+			gather.resize(size_t(w) * sampleSize);
+			const size_t stride = size_t(info->channels) * sampleSize;
+			for (int x = 0; x < w; ++x)
+				memcpy(&gather[size_t(x) * sampleSize], src + x * stride + channel * sampleSize, sampleSize);
+			src = gather.data();
+		}
+		float* out = dst.data() + size_t(y) * w;
+		if (sampleSize == 2)
+			PPMRow16(src, w, rscale, bias, out);
+		else
+			PPMRow8(src, w, rscale, bias, out);
+	};
+
+	constexpr int rowsPerJob = 64;
+	const int blocks = (info->height + rowsPerJob - 1) / rowsPerJob;
+	auto block = [&] (int b) {
+		std::vector<uint8_t> gather;
+		for (int y = b * rowsPerJob; y < std::min(info->height, (b + 1) * rowsPerJob); ++y)
+			convert(y, gather);
+	};
+	if (jobs) {
+		jobs->parallelFor(blocks, block);
+	} else {
+		for (int b = 0; b < blocks; ++b)
+			block(b);
+	}
+	return info;
+}
+
+Pipeline MakePipeline(Context&, const sg_shader_desc* (*fn)(sg_backend), const sg_layout_desc& layout, sg_index_type indexType, std::function<void(const Context& ctx)> frame, std::function<void(const Transform&)> draw)
+{
+	// the dummy backend has no shader sources of its own but accepts any desc
+	const sg_shader_desc* shaderDesc = fn(sg_query_backend());
+	sg_shader shader = sg_make_shader(shaderDesc ? shaderDesc : fn(SG_BACKEND_GLCORE33));
+
+	sg_pipeline_desc pip_desc{
+		.shader = shader,
+		.layout = layout,
+		.depth = {
+			.compare = SG_COMPAREFUNC_LESS,
+			.write_enabled = true,
+		},
+		.index_type = indexType,
+		.cull_mode = SG_CULLMODE_BACK,
+	};
+
+	return {
+		sg_make_pipeline(&pip_desc),
+		frame,
+		draw,
+	};
+}
+
+JobSystem::JobSystem(int workers)
+{
+	if (workers < 0)
+		workers = std::max(0, int(std::thread::hardware_concurrency()) - 1);
+	_threads.reserve(workers);
+	for (int i = 0; i < workers; ++i)
+		_threads.emplace_back([this] { work(); });
+}
+
+JobSystem::~JobSystem()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+	}
+	_cond.notify_all();
+	for (std::thread& t : _threads)
+		t.join();
+}
+
+void JobSystem::run(std::function<void()> job)
+{
+	if (_threads.empty()) {
+		job();
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_jobs.push_back(std::move(job));
+	}
+	_cond.notify_one();
+}
+
+void JobSystem::work()
+{
+	for (;;) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_cond.wait(lock, [this] { return _quit || !_jobs.empty(); });
+			if (_jobs.empty())
+				return;
+			job = std::move(_jobs.front());
+			_jobs.pop_front();
+		}
+		job();
+	}
+}
+
+void JobSystem::parallelFor(int count, const std::function<void(int)>& fn)
+{
+	if (count <= 0)
+		return;
+
+	// shared so that helpers picked up after the last index still have valid counters
+	struct State
+	{
+		std::atomic<int> next{ 0 };
+		std::atomic<int> done{ 0 };
+		int count{ 0 };
+		const std::function<void(int)>* fn{ nullptr };
+		std::mutex mutex;
+		std::condition_variable cond;
+	};
+	auto state = std::make_shared<State>();
+	state->count = count;
+	state->fn = &fn;
+
+	auto loop = [] (State& st) {
+		for (int i = st.next++; i < st.count; i = st.next++) {
+			(*st.fn)(i);
+			if (++st.done == st.count) {
+				std::lock_guard<std::mutex> lock(st.mutex);
+				st.cond.notify_all();
+			}
+		}
+	};
+
+	const int helpers = std::min(workerCount(), count - 1);
+	for (int i = 0; i < helpers; ++i)
+		run([state, loop] { loop(*state); });
+
+	loop(*state);
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cond.wait(lock, [&] { return state->done == state->count; });
+}
+
+int TransformHierarchy::add(const int parent, const vec3 translation, const quat rotation, const vec3 scale)
+{
+	int handle = int(_index.size());
+	if (!_free.empty()) {
+		handle = _free.back();
+		_free.pop_back();
+	} else {
+		_index.push_back(None);
+	}
+	const int i = size();
+	_index[handle] = i;
+	_handle.push_back(handle);
+	_parent.push_back(parent == None ? None : _index[parent]);
+	_tx.push_back(0.0f);
+	_ty.push_back(0.0f);
+	_tz.push_back(0.0f);
+	_rx.push_back(0.0f);
+	_ry.push_back(0.0f);
+	_rz.push_back(0.0f);
+	_rw.push_back(1.0f);
+	_sx.push_back(1.0f);
+	_sy.push_back(1.0f);
+	_sz.push_back(1.0f);
+	_dirty.push_back(1);
+	_world.push_back({ HMM_Mat4d(1.0f) });
+	setTranslation(handle, translation);
+	setRotation(handle, rotation);
+	setScale(handle, scale);
+	return handle;
+}
+
+void TransformHierarchy::remove(const int handle)
+{
+	// removing twice, or a descendant of a removed node, is a no op
+	if (handle < 0 || handle >= int(_index.size()) || _index[handle] == None)
+		return;
+
+	const int first = _index[handle];
+	const int n = size();
+	// descendants all come after first, a node goes when its parent went; remap holds new indices
+	std::vector<int> remap(n - first);
+	int out = first;
+	for (int i = first; i < n; ++i) {
+		const int p = _parent[i];
+		if (i == first || (p >= first && remap[p - first] == None)) {
+			remap[i - first] = None;
+			_index[_handle[i]] = None;
+			_free.push_back(_handle[i]);
+			continue;
+		}
+		remap[i - first] = out;
+		_parent[out] = p >= first ? remap[p - first] : p;
+		_tx[out] = _tx[i];
+		_ty[out] = _ty[i];
+		_tz[out] = _tz[i];
+		_rx[out] = _rx[i];
+		_ry[out] = _ry[i];
+		_rz[out] = _rz[i];
+		_rw[out] = _rw[i];
+		_sx[out] = _sx[i];
+		_sy[out] = _sy[i];
+		_sz[out] = _sz[i];
+		_dirty[out] = _dirty[i];
+		_world[out] = _world[i];
+		_handle[out] = _handle[i];
+		_index[_handle[out]] = out;
+		++out;
+	}
+	for (auto* v : { &_tx, &_ty, &_tz, &_rx, &_ry, &_rz, &_rw, &_sx, &_sy, &_sz })
+		v->resize(out);
+	_parent.resize(out);
+	_dirty.resize(out);
+	_world.resize(out);
+	_handle.resize(out);
+}
+
+void TransformHierarchy::reserve(const int count)
+{
+	for (auto* v : { &_tx, &_ty, &_tz, &_rx, &_ry, &_rz, &_rw, &_sx, &_sy, &_sz })
+		v->reserve(count);
+	_parent.reserve(count);
+	_dirty.reserve(count);
+	_world.reserve(count);
+	_handle.reserve(count);
+	_index.reserve(count);
+}
+
+void TransformHierarchy::markDirty(const int i)
+{
+	_dirty[i] = 1;
+	_changed = true;
+}
+
+void TransformHierarchy::setTranslation(const int handle, const vec3 t)
+{
+	const int i = _index[handle];
+	_tx[i] = t.X;
+	_ty[i] = t.Y;
+	_tz[i] = t.Z;
+	markDirty(i);
+}
+
+void TransformHierarchy::setRotation(const int handle, const quat r)
+{
+	const int i = _index[handle];
+	const float len2 = r.X * r.X + r.Y * r.Y + r.Z * r.Z + r.W * r.W;
+	const float rl = len2 > 0.0f ? 1.0f / std::sqrt(len2) : 0.0f;
+	_rx[i] = r.X * rl;
+	_ry[i] = r.Y * rl;
+	_rz[i] = r.Z * rl;
+	_rw[i] = len2 > 0.0f ? r.W * rl : 1.0f;
+	markDirty(i);
+}
+
+void TransformHierarchy::setScale(const int handle, const vec3 s)
+{
+	const int i = _index[handle];
+	_sx[i] = s.X;
+	_sy[i] = s.Y;
+	_sz[i] = s.Z;
+	markDirty(i);
+}
+
+vec3 TransformHierarchy::translation(const int handle) const
+{
+	const int i = _index[handle];
+	return { _tx[i], _ty[i], _tz[i] };
+}
+
+quat TransformHierarchy::rotation(const int handle) const
+{
+	const int i = _index[handle];
+	return HMM_Quaternion(_rx[i], _ry[i], _rz[i], _rw[i]);
+}
+
+vec3 TransformHierarchy::scale(const int handle) const
+{
+	const int i = _index[handle];
+	return { _sx[i], _sy[i], _sz[i] };
+}
+
+int TransformHierarchy::parent(const int handle) const
+{
+	const int p = _parent[_index[handle]];
+	return p == None ? None : _handle[p];
+}
+
+mat4 TransformHierarchy::local(const int i) const
+{
+	const float x = _rx[i], y = _ry[i], z = _rz[i], w = _rw[i];
+	mat4 m;
+	m.Elements[0][0] = (1.0f - 2.0f * (y * y + z * z)) * _sx[i];
+	m.Elements[0][1] = 2.0f * (x * y + w * z) * _sx[i];
+	m.Elements[0][2] = 2.0f * (x * z - w * y) * _sx[i];
+	m.Elements[0][3] = 0.0f;
+	m.Elements[1][0] = 2.0f * (x * y - w * z) * _sy[i];
+	m.Elements[1][1] = (1.0f - 2.0f * (x * x + z * z)) * _sy[i];
+	m.Elements[1][2] = 2.0f * (y * z + w * x) * _sy[i];
+	m.Elements[1][3] = 0.0f;
+	m.Elements[2][0] = 2.0f * (x * z + w * y) * _sz[i];
+	m.Elements[2][1] = 2.0f * (y * z - w * x) * _sz[i];
+	m.Elements[2][2] = (1.0f - 2.0f * (x * x + y * y)) * _sz[i];
+	m.Elements[2][3] = 0.0f;
+	m.Elements[3][0] = _tx[i];
+	m.Elements[3][1] = _ty[i];
+	m.Elements[3][2] = _tz[i];
+	m.Elements[3][3] = 1.0f;
+	return m;
+}
+
+void TransformHierarchy::update()
+{
+	PIPO_ZONE("TransformHierarchy::update");
+	if (!_changed)
+		return;
+	const int n = size();
+
+	// a single forward pass: parents come first, so they hand their dirty flag down and are final
+	// by the time their children are reached; locals never leave registers, world is written once
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 zero = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4) {
+		uint8_t any = 0;
+		for (int k = i; k < i + 4; ++k) {
+			if (_parent[k] != None)
+				_dirty[k] |= _dirty[_parent[k]];
+			any |= _dirty[k];
+		}
+		if (!any)
+			continue;
+
+		const __m128 x = _mm_loadu_ps(&_rx[i]);
+		const __m128 y = _mm_loadu_ps(&_ry[i]);
+		const __m128 z = _mm_loadu_ps(&_rz[i]);
+		const __m128 w = _mm_loadu_ps(&_rw[i]);
+		const __m128 x2 = _mm_mul_ps(x, two);
+		const __m128 y2 = _mm_mul_ps(y, two);
+		const __m128 z2 = _mm_mul_ps(z, two);
+		const __m128 xx = _mm_mul_ps(x, x2);
+		const __m128 yy = _mm_mul_ps(y, y2);
+		const __m128 zz = _mm_mul_ps(z, z2);
+		const __m128 xy = _mm_mul_ps(x, y2);
+		const __m128 xz = _mm_mul_ps(x, z2);
+		const __m128 yz = _mm_mul_ps(y, z2);
+		const __m128 wx = _mm_mul_ps(w, x2);
+		const __m128 wy = _mm_mul_ps(w, y2);
+		const __m128 wz = _mm_mul_ps(w, z2);
+		const __m128 sx = _mm_loadu_ps(&_sx[i]);
+		const __m128 sy = _mm_loadu_ps(&_sy[i]);
+		const __m128 sz = _mm_loadu_ps(&_sz[i]);
+
+		// one register per matrix element across the four nodes, transposed into one column per node
+		__m128 c[4][4] = {
+			{ _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx), _mm_mul_ps(_mm_add_ps(xy, wz), sx), _mm_mul_ps(_mm_sub_ps(xz, wy), sx), zero },
+			{ _mm_mul_ps(_mm_sub_ps(xy, wz), sy), _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy), _mm_mul_ps(_mm_add_ps(yz, wx), sy), zero },
+			{ _mm_mul_ps(_mm_add_ps(xz, wy), sz), _mm_mul_ps(_mm_sub_ps(yz, wx), sz), _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz), zero },
+			{ _mm_loadu_ps(&_tx[i]), _mm_loadu_ps(&_ty[i]), _mm_loadu_ps(&_tz[i]), one },
+		};
+		for (int col = 0; col < 4; ++col)
+			_MM_TRANSPOSE4_PS(c[col][0], c[col][1], c[col][2], c[col][3]);
+
+		for (int k = 0; k < 4; ++k) {
+			if (!_dirty[i + k])
+				continue;
+			float* out = &_world[i + k].world.Elements[0][0];
+			const int p = _parent[i + k];
+			if (p == None) {
+				for (int col = 0; col < 4; ++col)
+					_mm_storeu_ps(out + 4 * col, c[col][k]);
+				continue;
+			}
+			const float* a = &_world[p].world.Elements[0][0];
+			const __m128 a0 = _mm_loadu_ps(a);
+			const __m128 a1 = _mm_loadu_ps(a + 4);
+			const __m128 a2 = _mm_loadu_ps(a + 8);
+			const __m128 a3 = _mm_loadu_ps(a + 12);
+			for (int col = 0; col < 4; ++col) {
+				const __m128 l = c[col][k];
+				__m128 r = _mm_mul_ps(a0, _mm_shuffle_ps(l, l, _MM_SHUFFLE(0, 0, 0, 0)));
+				r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_shuffle_ps(l, l, _MM_SHUFFLE(1, 1, 1, 1))));
+				r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_shuffle_ps(l, l, _MM_SHUFFLE(2, 2, 2, 2))));
+				r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_shuffle_ps(l, l, _MM_SHUFFLE(3, 3, 3, 3))));
+				_mm_storeu_ps(out + 4 * col, r);
+			}
+		}
+	}
+#endif
+	for (; i < n; ++i) {
+		const int p = _parent[i];
+		if (p != None)
+			_dirty[i] |= _dirty[p];
+		if (_dirty[i])
+			_world[i].world = p == None ? local(i) : HMM_MultiplyMat4(_world[p].world, local(i));
 	}
 
-	if (const std::pair<sg_buffer, int>* piid = std::get_if<std::pair<sg_buffer, int>>(&indice); piid) {
-		iid = piid->first;
-		sz = piid->second;
-	} else if (const std::vector<uint16_t>* idata = std::get_if<std::vector<uint16_t>>(&indice); idata) {
-		iid = sg_make_buffer({
-			//.size = int(idata->size() * sizeof(uint16_t)),
-			.type = SG_BUFFERTYPE_INDEXBUFFER,
-			.data = { &((*idata)[0]), idata->size() * sizeof(uint16_t) },
-		});
-		sz = idata->size();
+	std::fill(_dirty.begin(), _dirty.end(), 0);
+	_changed = false;
+}
+
+namespace {
+
+struct ProfileState
+{
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ProfileRing>> rings;
+	std::atomic<uint32_t> frame{ 0 };
+};
+
+ProfileState& Profile()
+{
+	static ProfileState state;
+	return state;
+}
+
+ProfileRing& ThreadRing()
+{
+	thread_local ProfileRing* ring = nullptr;
+	if (ring == nullptr) {
+		ProfileState& state = Profile();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.rings.push_back(std::make_unique<ProfileRing>());
+		ring = state.rings.back().get();
+		ring->thread = int(state.rings.size()) - 1;
 	}
+	return *ring;
+}
 
-	return { &context.plDefault, context.txWhite, *vid, *iid, sz };
+// rings live until exit, so the pointers stay valid once taken
+std::vector<const ProfileRing*> ProfileRings()
+{
+	ProfileState& state = Profile();
+	std::lock_guard<std::mutex> lock(state.mutex);
+	std::vector<const ProfileRing*> rings;
+	for (const auto& ring : state.rings)
+		rings.push_back(ring.get());
+	return rings;
 }
 
-Mesh MakeHMap(Context& context, const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const std::function<float(int, int)>& f)
+// the zones still in the ring from frame since on, oldest first
+void CopyRing(const ProfileRing& ring, std::vector<ProfileZone>& out, const uint32_t since = 0)
 {
-	std::vector<BaseVertex> vertice;
-	std::vector<vec3> normals;
-	std::vector<uint16_t> indice;
+	const uint32_t head = ring.head.load(std::memory_order_acquire);
+	uint32_t count = std::min(head, ProfileRing::Size);
+	// stamps only grow within one ring, so those are the newest zones
+	if (since > 0) {
+		uint32_t n = 0;
+		while (n < count && ring.zones[(head - 1 - n) & (ProfileRing::Size - 1)].frame >= since)
+			++n;
+		count = n;
+	}
+	const size_t first = out.size();
+	for (uint32_t i = head - count; i != head; ++i)
+		out.push_back(ring.zones[i & (ProfileRing::Size - 1)]);
 
-	const float xsz = (max.X - min.X) / w;
-	const float ysz = (max.Y - min.Y) / h;
-	const float mweight = 4.0f;
+	// the writer lapped whatever is older than its current slot minus the ring size
+	const int64_t after = ring.head.load(std::memory_order_acquire);
+	const int64_t lapped = after + 1 - int64_t(ProfileRing::Size) - int64_t(head - count);
+	if (lapped > 0)
+		out.erase(out.begin() + first, out.begin() + first + std::min<size_t>(size_t(lapped), count));
+}
 
-	vertice.reserve(w * h);
-	normals.reserve(w * h);
-	for (int y = 0; y < h; ++y) {
-		const float ry = (float(y) / float(h - 1));
-		const float fy = min.Y + (max.Y - min.Y) * ry;
-		for (int x = 0; x < w; ++x) {
-			const float rx = (float(x) / float(w - 1));
-			const float fx = min.X + (max.X - min.X) * rx;
+}
 
-			const float tz = f(ox + x, oy + y);
-			const float zl = f(ox + x - 1, oy + y);
-			const float zr = f(ox + x + 1, oy + y);
-			const float zu = f(ox + x, oy + y - 1);
-			const float zd = f(ox + x, oy + y + 1);
-			const float zul = f(ox + x - 1, oy + y - 1);
-			const float zur = f(ox + x + 1, oy + y - 1);
-			const float zdl = f(ox + x - 1, oy + y + 1);
-			const float zdr = f(ox + x + 1, oy + y + 1);
+void ProfileRecord(const char* name, uint64_t start, uint64_t end)
+{
+	ProfileRing& ring = ThreadRing();
+	const uint32_t head = ring.head.load(std::memory_order_relaxed);
+	ring.zones[head & (ProfileRing::Size - 1)] = { name, start, end, Profile().frame.load(std::memory_order_relaxed) };
+	ring.head.store(head + 1, std::memory_order_release);
+}
 
-			const float dx = (mweight * (zl - zr) + (zul - zur) + (zdr - zdl)) / (2.0f + mweight);
-			const float dy = (mweight * (zu - zd) + (zul - zdl) + (zur - zdr)) / (2.0f + mweight);
+void ProfileFrame(uint32_t frame)
+{
+	Profile().frame.store(frame, std::memory_order_relaxed);
+}
 
-			const vec3 v0{ -2.0f * xsz, 0.0f, dx };
-			const vec3 v1{ 0.0f, -2.0f * ysz, dy };
-			const vec3 n = HMM_Normalize(HMM_Cross(v0, v1));
+void CollectProfile(Context& ctx, uint32_t frame)
+{
+	ctx.profile.clear();
+	std::vector<ProfileZone> zones;
+	for (const ProfileRing* ring : ProfileRings()) {
+		// other threads keep writing, CopyRing drops what they overwrote during the copy
+		zones.clear();
+		CopyRing(*ring, zones, frame);
+		for (const ProfileZone& zone : zones) {
+			if (zone.frame != frame)
+				continue;
 
-			normals.push_back(n);
-			vertice.push_back({
-				{ fx, fy, tz },
-				{ n.X, n.Y, n.Z },
-				{ rx, ry },
-				0xffff00ff
+			auto it = std::find_if(ctx.profile.begin(), ctx.profile.end(), [&] (const ProfileStat& s) {
+				return s.name == zone.name || strcmp(s.name, zone.name) == 0;
 			});
+			if (it == ctx.profile.end())
+				it = ctx.profile.insert(ctx.profile.end(), { zone.name, 0, 0.0 });
+			++it->calls;
+			it->ms += stm_ms(zone.end - zone.start);
 		}
 	}
+	std::sort(ctx.profile.begin(), ctx.profile.end(), [] (const ProfileStat& a, const ProfileStat& b) { return a.ms > b.ms; });
+}
 
-	auto& hmapIid = context.hmapIndexBuffer[{ w, h }];
-	if (hmapIid.second == 0) {
-		indice.reserve(6 * (w - 1) * (h - 1));
-		for (int y = 0; y < h - 1; ++y) {
-			for (int x = 0; x < w - 1; ++x) {
-				const uint16_t i0 = y * w + x;
-				const uint16_t i1 = i0 + 1;
-				const uint16_t i2 = i0 + w;
-				const uint16_t i3 = i1 + w;
-				if ((x ^ y) & 1) {
-					const std::array<uint16_t, 6> face{ i0, i3, i2, i1, i3, i0 };
-					indice.insert(indice.end(), face.begin(), face.end());
-				} else {
-					const std::array<uint16_t, 6> face{ i0, i1, i2, i1, i3, i2 };
-					indice.insert(indice.end(), face.begin(), face.end());
-				}
-			}
+bool WriteChromeTrace(std::string_view path, int frames)
+{
+	const uint32_t current = Profile().frame.load(std::memory_order_relaxed);
+
+	FILE* f = fopen(std::string(path).c_str(), "w");
+	if (!f)
+		return false;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	bool first = true;
+	std::vector<ProfileZone> zones;
+	for (const ProfileRing* ring : ProfileRings()) {
+		zones.clear();
+		CopyRing(*ring, zones);
+		for (const ProfileZone& zone : zones) {
+			if (int64_t(zone.frame) + frames <= int64_t(current))
+				continue;
+			fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"frame\":%u}}",
+				first ? "" : ",", zone.name, stm_us(zone.start), stm_us(zone.end - zone.start), ring->thread, zone.frame);
+			first = false;
 		}
-		auto iid = sg_make_buffer({
-			.type = SG_BUFFERTYPE_INDEXBUFFER,
-			.data= { &indice[0], indice.size() * sizeof(uint16_t) },
-		});
-		hmapIid = { iid, indice.size() };
 	}
+	fprintf(f, "\n]}\n");
 
-	return MakeMesh(context, vertice, hmapIid);
+	const bool ok = ferror(f) == 0;
+	return fclose(f) == 0 && ok;
 }
 
-std::optional<Mesh> LoadMesh(Context& context, std::string_view path)
+namespace {
+
+constexpr const char* TransformsMeta = "pipo.Transforms";
+constexpr const char* MeshIdsMeta = "pipo.MeshIds";
+
+// a view on an engine owned array, it lives as long as its pipo.<name> field
+struct ScriptArray
 {
-	std::ifstream in(path.data());
-	if (!in)
-		return {};
+	void* data;
+	int count;
+};
 
-	enum Cmp {
-		px, py, pz, nx, ny, nz, u, v, r, g, b, a, count,
-	};
+template <typename T>
+T* ScriptData(lua_State* L, const char* meta, ScriptArray*& a)
+{
+	a = static_cast<ScriptArray*>(luaL_checkudata(L, 1, meta));
+	return static_cast<T*>(a->data);
+}
 
-	const std::map<std::string, Cmp> idToCmp = {
-		{ "x", px },
-		{ "y", py },
-		{ "z", pz },
-		{ "nx", nx },
-		{ "ny", ny },
-		{ "nz", nz },
-		{ "u", u },
-		{ "u", v },
-		{ "red", r },
-		{ "green", g },
-		{ "blue", b },
-		{ "alpha", a },
-	};
+int ScriptIndex(lua_State* L, const ScriptArray& a, int arg)
+{
+	const lua_Integer i = luaL_checkinteger(L, arg);
+	luaL_argcheck(L, i >= 1 && i <= a.count, arg, "index out of range");
+	return int(i - 1);
+}
 
-	std::vector<std::pair<int, std::vector<Cmp>>> format;
-	char buffer[512];
-
-	while (in.getline(buffer, sizeof(buffer))) {
-		if (strncmp(buffer, "element", 7) == 0) {
-			std::istringstream str(buffer + 8);
-			std::string type, count;
-			str >> type >> count;
-			format.push_back({ std::stoi(count), {} });
-		} else if (strncmp(buffer, "property", 8) == 0) {
-			std::istringstream str(buffer + 9);
-			std::string fmt, cmp;
-			str >> fmt >> cmp;
-			auto& cmps = format.back().second;
-			auto itf = idToCmp.find(cmp);
-			if (itf != idToCmp.end())
-				cmps.push_back(itf->second);
-		} else if (strncmp(buffer, "end_header", 10) == 0) {
-			break;
-		}
-	}
+// optional 1-based first and count at arg, arg + 1, clamped to the array, returned as [begin, end)
+std::pair<int, int> ScriptRange(lua_State* L, const ScriptArray& a, int arg)
+{
+	const lua_Integer first = std::max<lua_Integer>(1, luaL_optinteger(L, arg, 1));
+	const lua_Integer count = std::clamp<lua_Integer>(luaL_optinteger(L, arg + 1, a.count), 0, a.count);
+	// both ends stay inside the array, a range starting past it is empty
+	const lua_Integer begin = std::min<lua_Integer>(first - 1, a.count);
+	const lua_Integer end = std::min<lua_Integer>(a.count, begin + count);
+	return { int(begin), int(std::max(begin, end)) };
+}
 
-	if (format.size() != 2)
-		return {};
+int ScriptLen(lua_State* L)
+{
+	lua_pushinteger(L, static_cast<ScriptArray*>(lua_touserdata(L, 1))->count);
+	return 1;
+}
 
-	std::vector<BaseVertex> vertice;
-	std::vector<uint16_t> indice;
+// t:position(i) -> x, y, z
+int TransformsPosition(lua_State* L)
+{
+	ScriptArray* a;
+	const Transform* t = ScriptData<Transform>(L, TransformsMeta, a) + ScriptIndex(L, *a, 2);
+	for (int k = 0; k < 3; ++k)
+		lua_pushnumber(L, t->world.Elements[3][k]);
+	return 3;
+}
 
-	{
-		const auto& part = format[0];
-		vertice.reserve(part.first);
-		std::array<float, count> data;
-		std::string item;
-		for (int i = 0; i < part.first; ++i) {
-			if (!in.getline(buffer, sizeof(buffer)))
-				return {};
-			std::istringstream str(buffer);
-			std::fill(data.begin(), data.end(), 0.5f);
-			for (Cmp cmp : part.second) {
-				str >> item;
-				const float v = stof(item);
-				data[cmp] = v;
-			}
-			vertice.push_back({
-				{ data[px], data[py], data[pz] },
-				{ data[nx], data[ny], data[nz] },
-				{ data[u], data[v] },
-				{ 0xff00ff00 },
-			});
-		}
-	}
+// t:setPosition(i, x, y, z)
+int TransformsSetPosition(lua_State* L)
+{
+	ScriptArray* a;
+	Transform* t = ScriptData<Transform>(L, TransformsMeta, a) + ScriptIndex(L, *a, 2);
+	for (int k = 0; k < 3; ++k)
+		t->world.Elements[3][k] = float(luaL_checknumber(L, 3 + k));
+	return 0;
+}
 
-	{
-		const auto& part = format[1];
-		indice.reserve(3 * part.first);
-		std::string c, v0, v1, v2;
-		for (int i = 0; i < part.first; ++i) {
-			if (!in.getline(buffer, sizeof(buffer)))
-				return {};
-			std::istringstream str(buffer);
-			str >> c >> v0 >> v1 >> v2;
-			const int i0 = std::stoi(v0);
-			const int i1 = std::stoi(v1);
-			const int i2 = std::stoi(v2);
-			indice.push_back(i0);
-			indice.push_back(i1);
-			indice.push_back(i2);
-		}
+// t:translate(dx, dy, dz [, first, count]), in world space
+int TransformsTranslate(lua_State* L)
+{
+	ScriptArray* a;
+	Transform* t = ScriptData<Transform>(L, TransformsMeta, a);
+	const vec3 d{ float(luaL_checknumber(L, 2)), float(luaL_checknumber(L, 3)), float(luaL_checknumber(L, 4)) };
+	const auto [begin, end] = ScriptRange(L, *a, 5);
+	for (int i = begin; i < end; ++i) {
+		t[i].world.Elements[3][0] += d.X;
+		t[i].world.Elements[3][1] += d.Y;
+		t[i].world.Elements[3][2] += d.Z;
 	}
-
-	return MakeMesh(context, vertice, indice);
+	return 0;
 }
 
-void DrawMesh(Context& ctx, const Mesh& mesh, const Transform& t)
+// t:rotate(degrees, ax, ay, az [, first, count]), around each transform's own origin
+int TransformsRotate(lua_State* L)
 {
-	if (mesh.pcount <= 0)
-		return;
+	ScriptArray* a;
+	Transform* t = ScriptData<Transform>(L, TransformsMeta, a);
+	const float angle = float(luaL_checknumber(L, 2));
+	const vec3 axis{ float(luaL_checknumber(L, 3)), float(luaL_checknumber(L, 4)), float(luaL_checknumber(L, 5)) };
+	const mat4 rot = HMM_Rotate(angle, axis);
+	const auto [begin, end] = ScriptRange(L, *a, 6);
+	for (int i = begin; i < end; ++i)
+		t[i].world = t[i].world * rot;
+	return 0;
+}
 
-	if (ctx.lastPip.id != mesh.pip->pl.id) {
-		ctx.lastPip = mesh.pip->pl;
-		sg_apply_pipeline(mesh.pip->pl);
-		mesh.pip->frame(ctx);
+// t:positions(out [, first, count]) fills out with x, y, z triples and returns it
+int TransformsPositions(lua_State* L)
+{
+	ScriptArray* a;
+	const Transform* t = ScriptData<Transform>(L, TransformsMeta, a);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	const auto [begin, end] = ScriptRange(L, *a, 3);
+	lua_Integer n = 1;
+	for (int i = begin; i < end; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			lua_pushnumber(L, t[i].world.Elements[3][k]);
+			lua_rawseti(L, 2, n++);
+		}
 	}
+	lua_pushvalue(L, 2);
+	return 1;
+}
 
-	const sg_bindings bd = {
-		.vertex_buffers = { mesh.vid },
-		.index_buffer = mesh.iid,
-		.fs_images = { mesh.diffuse.iid },
-	};
+// t:setPositions(src [, first]) takes x, y, z triples from src
+int TransformsSetPositions(lua_State* L)
+{
+	ScriptArray* a;
+	Transform* t = ScriptData<Transform>(L, TransformsMeta, a);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	const int begin = ScriptRange(L, *a, 3).first;
+	const int end = std::min<lua_Integer>(a->count, begin + luaL_len(L, 2) / 3);
+	lua_Integer n = 1;
+	for (int i = begin; i < end; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			lua_rawgeti(L, 2, n++);
+			t[i].world.Elements[3][k] = float(lua_tonumber(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	return 0;
+}
 
-	sg_apply_bindings(&bd);
+// m:get(i) -> id
+int MeshIdsGet(lua_State* L)
+{
+	ScriptArray* a;
+	const int32_t* ids = ScriptData<int32_t>(L, MeshIdsMeta, a);
+	lua_pushinteger(L, ids[ScriptIndex(L, *a, 2)]);
+	return 1;
+}
 
-	mesh.pip->draw(t);
+// m:set(i, id)
+int MeshIdsSet(lua_State* L)
+{
+	ScriptArray* a;
+	int32_t* ids = ScriptData<int32_t>(L, MeshIdsMeta, a);
+	ids[ScriptIndex(L, *a, 2)] = int32_t(luaL_checkinteger(L, 3));
+	return 0;
+}
 
-	sg_draw(0, mesh.pcount, 1);
+// m:fill(id [, first, count])
+int MeshIdsFill(lua_State* L)
+{
+	ScriptArray* a;
+	int32_t* ids = ScriptData<int32_t>(L, MeshIdsMeta, a);
+	const int32_t id = int32_t(luaL_checkinteger(L, 2));
+	const auto [begin, end] = ScriptRange(L, *a, 3);
+	std::fill(ids + begin, ids + end, id);
+	return 0;
 }
 
-Texture MakeTextureRGBA(int w, int h, const std::vector<uint32_t>& data)
+// m:values(out [, first, count]) fills out and returns it
+int MeshIdsValues(lua_State* L)
 {
-	auto iid = sg_make_image({
-		.width = w,
-		.height = h,
-		.data = {
-			.subimage = {
-				{ { &data[0], w * h * 4u } }
-			}
-		}
-	});
-	return { iid };
+	ScriptArray* a;
+	const int32_t* ids = ScriptData<int32_t>(L, MeshIdsMeta, a);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	const auto [begin, end] = ScriptRange(L, *a, 3);
+	for (int i = begin; i < end; ++i) {
+		lua_pushinteger(L, ids[i]);
+		lua_rawseti(L, 2, i - begin + 1);
+	}
+	lua_pushvalue(L, 2);
+	return 1;
 }
 
-std::optional<Texture> LoadDDS(const std::vector<std::string>& arrayItems)
+// m:setValues(src [, first])
+int MeshIdsSetValues(lua_State* L)
 {
-	tinyddsloader::DDSFile dds;
+	ScriptArray* a;
+	int32_t* ids = ScriptData<int32_t>(L, MeshIdsMeta, a);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	const int begin = ScriptRange(L, *a, 3).first;
+	const int end = std::min<lua_Integer>(a->count, begin + luaL_len(L, 2));
+	for (int i = begin; i < end; ++i) {
+		lua_rawgeti(L, 2, i - begin + 1);
+		ids[i] = int32_t(lua_tointeger(L, -1));
+		lua_pop(L, 1);
+	}
+	return 0;
+}
 
-	/*auto loadStatus =*/ dds.Load(arrayItems[0].c_str());
+void ScriptMeta(lua_State* L, const char* name, const luaL_Reg* methods)
+{
+	luaL_newmetatable(L, name);
+	lua_pushcfunction(L, ScriptLen);
+	lua_setfield(L, -2, "__len");
+	lua_newtable(L);
+	luaL_setfuncs(L, methods, 0);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+}
 
-	const int w = dds.GetWidth();
-	const int h = dds.GetHeight();
-	const int mips = dds.GetMipCount();
+// standard libs, the pipo table and the array metatables
+void BindScriptLib(lua_State* L)
+{
+	luaL_openlibs(L);
 
-	sg_image_desc img_desc {
-		.width = w,
-		.height = h,
-		.num_mipmaps = mips,
-		.max_anisotropy = 4,
+	const luaL_Reg transforms[] = {
+		{ "position", TransformsPosition },
+		{ "setPosition", TransformsSetPosition },
+		{ "translate", TransformsTranslate },
+		{ "rotate", TransformsRotate },
+		{ "positions", TransformsPositions },
+		{ "setPositions", TransformsSetPositions },
+		{ nullptr, nullptr },
 	};
+	ScriptMeta(L, TransformsMeta, transforms);
 
-	for (int i = 0; i < mips; ++i) {
-		const tinyddsloader::DDSFile::ImageData* data = dds.GetImageData(i);
-		img_desc.data.subimage[0][i] = {
-			.ptr = data->m_mem,
-			.size = data->m_memSlicePitch,
-		};
-	}
+	const luaL_Reg meshIds[] = {
+		{ "get", MeshIdsGet },
+		{ "set", MeshIdsSet },
+		{ "fill", MeshIdsFill },
+		{ "values", MeshIdsValues },
+		{ "setValues", MeshIdsSetValues },
+		{ nullptr, nullptr },
+	};
+	ScriptMeta(L, MeshIdsMeta, meshIds);
 
-	Texture tex{ sg_make_image(&img_desc) };
-	return tex;
+	lua_newtable(L);
+	lua_setglobal(L, "pipo");
 }
 
-void LoadPPM(
-	std::string_view path,
-	const std::function<void (int, int)>& init,
-	const std::function<void (std::array<float, 3>)>& pix
-)
+void BindArray(lua_State* L, const char* meta, std::string_view name, void* data, int count)
 {
-	FILE* f = fopen(path.data(), "rb");
+	const std::string key(name);
+	lua_getglobal(L, "pipo");
+	lua_getfield(L, -1, key.c_str());
+	ScriptArray* a = static_cast<ScriptArray*>(luaL_testudata(L, -1, meta));
+	lua_pop(L, 1);
+	if (!a) {
+		a = static_cast<ScriptArray*>(lua_newuserdata(L, sizeof(ScriptArray)));
+		luaL_setmetatable(L, meta);
+		lua_setfield(L, -2, key.c_str());
+	}
+	*a = { data, count };
+	lua_pop(L, 1);
+}
 
-	char buffer[256];
-	fgets(buffer, sizeof(buffer), f);
-	std::cout << buffer;
-	fgets(buffer, sizeof(buffer), f);
-	std::cout << buffer;
-	fgets(buffer, sizeof(buffer), f);
-	std::cout << buffer;
-	fgets(buffer, sizeof(buffer), f);
-	std::cout << buffer;
+}
 
-	init(512, 512);
-	uint8_t rgb[6];
-	const int s0 = 8;
-	const int s1 = 0;
-	for (int y = 0; y < 512; ++y) {
-		for (int x = 0; x < 512; ++x) {
-			/*size_t ct =*/ fread(&rgb, 1, 6, f);
-			int r = (rgb[0] << s0) + (rgb[1] << s1);
-			int g = (rgb[2] << s0) + (rgb[3] << s1);
-			int b = (rgb[4] << s0) + (rgb[5] << s1);
-			pix({ float(r) / 65535.0f, float(g) / 65535.0f, float(b) / 65535.0f });
-		}
+bool LoadScript(Context& ctx, std::string_view path)
+{
+	PIPO_ZONE("LoadScript");
+	lua_State* L = ctx.interp;
+	const std::string file(path);
+	if (luaL_loadfile(L, file.c_str()) != LUA_OK || lua_pcall(L, 0, 0, 0) != LUA_OK) {
+		SDL_Log("%s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return false;
 	}
+	return true;
 }
 
-Pipeline MakePipeline(Context&, const sg_shader_desc* (*fn)(sg_backend), std::function<void(const Context& ctx)> frame, std::function<void(const Transform&)> draw)
+void BindTransforms(Context& ctx, std::string_view name, Transform* data, int count)
 {
-	sg_shader shader = sg_make_shader(fn(sg_query_backend()));
-
-	sg_pipeline_desc pip_desc{
-		.shader = shader,
-		.depth = {
-			.compare = SG_COMPAREFUNC_LESS,
-			.write_enabled = true,
-		},
-		.index_type = SG_INDEXTYPE_UINT16,
-		.cull_mode = SG_CULLMODE_BACK,
-	};
+	BindArray(ctx.interp, TransformsMeta, name, data, count);
+}
 
-	using VtxInfo = AttrInfo<BaseVertex>;
-	pip_desc.layout = {
-		.attrs = {
-			[ATTR_vs_default_vposition] = { 0, VtxInfo::offset(&BaseVertex::pos), SG_VERTEXFORMAT_FLOAT3 },
-			[ATTR_vs_default_vnormal] = { 0, VtxInfo::offset(&BaseVertex::normal), SG_VERTEXFORMAT_FLOAT3 },
-			[ATTR_vs_default_vtextcoord] = { 0, VtxInfo::offset(&BaseVertex::uv), SG_VERTEXFORMAT_FLOAT2 },
-			[ATTR_vs_default_vcolor] = { 0, VtxInfo::offset(&BaseVertex::color), SG_VERTEXFORMAT_UBYTE4N },
-		},
-	};
+void BindMeshIds(Context& ctx, std::string_view name, int32_t* data, int count)
+{
+	BindArray(ctx.interp, MeshIdsMeta, name, data, count);
+}
 
-	return {
-		sg_make_pipeline(&pip_desc),
-		frame,
-		draw,
-	};
+bool UpdateScripts(Context& ctx, const UpdateParams& params, double budgetMs)
+{
+	lua_State* L = ctx.interp;
+	const uint64_t start = stm_now();
+	const int kb = lua_gc(L, LUA_GCCOUNT, 0);
+	bool ok = true;
+	{
+		PIPO_ZONE("Script");
+		// drops the error message, or update when it is not a function
+		const int top = lua_gettop(L);
+		if (lua_getglobal(L, "update") == LUA_TFUNCTION) {
+			lua_pushinteger(L, params.step);
+			lua_pushnumber(L, params.elapsed);
+			lua_pushinteger(L, params.updateMs);
+			ok = lua_pcall(L, 3, 0, 0) == LUA_OK;
+			if (!ok)
+				SDL_Log("%s", lua_tostring(L, -1));
+		}
+		lua_settop(L, top);
+	}
+	const uint64_t gcStart = stm_now();
+	{
+		PIPO_ZONE("ScriptGC");
+		// the first step pays for what the script allocated even when it overran, so the heap cannot
+		// outgrow the collector; the rest of the budget goes to basic steps, stopping once a cycle completes
+		const int allocated = std::max(lua_gc(L, LUA_GCCOUNT, 0) - kb, 1);
+		bool done = lua_gc(L, LUA_GCSTEP, allocated);
+		while (!done && stm_ms(stm_since(start)) < budgetMs)
+			done = lua_gc(L, LUA_GCSTEP, 0);
+	}
+	ctx.scripts.scriptMs.store(stm_ms(stm_diff(gcStart, start)), std::memory_order_relaxed);
+	ctx.scripts.gcMs.store(stm_ms(stm_since(gcStart)), std::memory_order_relaxed);
+	ctx.scripts.memoryKb.store(size_t(lua_gc(L, LUA_GCCOUNT, 0)), std::memory_order_relaxed);
+	return ok;
 }
 
 bool Init(Context& context)
 {
 	lua_State*& interp = context.interp;
 	interp = luaL_newstate();
+	BindScriptLib(interp);
+
+	context.jobs = std::make_unique<JobSystem>();
+	context.textures = std::make_unique<TextureStream>();
 
+#if defined(SOKOL_DUMMY_BACKEND)
+	// headless, nothing is presented so no gl context either
+	SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
+
+	constexpr auto flags = SDL_WINDOW_HIDDEN;
+	context.window = SDL_CreateWindow("Window", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1280, 720, flags);
+#else
 	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER);
 
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
@@ -386,6 +4200,7 @@ bool Init(Context& context)
 	SDL_GL_SetSwapInterval(1);
 
 	glewInit();
+#endif
 
 	sg_desc desc_sg {
 		.buffer_pool_size = 2048,
@@ -396,39 +4211,94 @@ bool Init(Context& context)
 
 	//SDL_
 
-	context.plDefault = MakePipeline(
-		context,
-		&default_shader_desc,
-		[] (const Context& ctx) {
-			params_default_pass_t ubPass {
-				.view = ctx.view,
-				.proj = ctx.proj,
-			};
-			sg_apply_uniforms(SG_SHADERSTAGE_VS, SLOT_params_default_pass, { &ubPass, sizeof(ubPass) });
-			params_default_lighting_t ubLighting {
-				.lightdir = ctx.lightdir,
-			};
-			sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_params_default_lighting, { &ubLighting, sizeof(ubLighting) });
-		},
-		[] (const Transform& transform) {
-			params_default_instance_t ubInstance {
-				.world = transform.world
-			};
-			sg_apply_uniforms(SG_SHADERSTAGE_VS, SLOT_params_default_instance, { &ubInstance, sizeof(ubInstance) });
-		}
-	);
+	// layouts number attributes in declaration order, like sokol-shdc does
+	static_assert(ATTR_vs_default_vcolor == 3 && ATTR_vs_instanced_iworld0 == 4, "unexpected default attribute order");
+	static_assert(ATTR_vs_packed_vcolor == 3 && ATTR_vs_packed_instanced_iworld0 == 4, "unexpected packed attribute order");
+	static_assert(ATTR_vs_terrain_vgrid == 2 && ATTR_vs_terrain_array_vgrid == 2, "unexpected terrain attribute order");
+
+	auto frame = [] (const Context& ctx) {
+		params_default_pass_t ubPass {
+			.view = ctx.view,
+			.proj = ctx.proj,
+		};
+		sg_apply_uniforms(SG_SHADERSTAGE_VS, SLOT_params_default_pass, { &ubPass, sizeof(ubPass) });
+		params_default_lighting_t ubLighting {
+			.lightdir = ctx.lightdir,
+		};
+		sg_apply_uniforms(SG_SHADERSTAGE_FS, SLOT_params_default_lighting, { &ubLighting, sizeof(ubLighting) });
+	};
+	auto draw = [] (const Transform& transform) {
+		params_default_instance_t ubInstance {
+			.world = transform.world
+		};
+		sg_apply_uniforms(SG_SHADERSTAGE_VS, SLOT_params_default_instance, { &ubInstance, sizeof(ubInstance) });
+	};
+	// instanced pipelines take the world matrix from buffer 1
+	auto drawInstanced = [] (const Transform&) {};
+
+	// every pipeline comes in a 16-bit and a 32-bit index flavour
+	auto makePipelines = [&] (Pipeline& pip, Pipeline& wide, const sg_shader_desc* (*fn)(sg_backend), const sg_layout_desc& layout, std::function<void(const Transform&)> drawFn) {
+		pip = MakePipeline(context, fn, layout, SG_INDEXTYPE_UINT16, frame, drawFn);
+		wide = MakePipeline(context, fn, layout, SG_INDEXTYPE_UINT32, frame, drawFn);
+		pip.wide = &wide;
+		wide.wide = &wide;
+	};
+
+	makePipelines(context.plDefault, context.plDefaultWide, &default_shader_desc, VertexLayout<BaseVertex>(), draw);
+	makePipelines(context.plInstanced, context.plInstancedWide, &instanced_shader_desc, VertexLayout<BaseVertex, Transform>(), drawInstanced);
+	context.plDefault.instanced = &context.plInstanced;
+	context.plDefaultWide.instanced = &context.plInstancedWide;
 
-	context.txWhite = MakeTextureRGBA(2, 2, { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff });
-	context.txChecker = MakeTextureRGBA(2, 2, { 0xffffffff, 0x000000ff, 0x000000ff, 0xffffffff });
+	makePipelines(context.plPacked, context.plPackedWide, &packed_shader_desc, VertexLayout<PackedVertex>(), draw);
+	makePipelines(context.plPackedInstanced, context.plPackedInstancedWide, &packed_instanced_shader_desc, VertexLayout<PackedVertex, Transform>(), drawInstanced);
+	context.plPacked.instanced = &context.plPackedInstanced;
+	context.plPackedWide.instanced = &context.plPackedInstancedWide;
+
+	makePipelines(context.plTerrain, context.plTerrainWide, &terrain_shader_desc, VertexLayout<TerrainVertex, TerrainGridVertex>(), draw);
+	makePipelines(context.plTerrainArray, context.plTerrainArrayWide, &terrain_array_shader_desc, VertexLayout<TerrainVertex, TerrainGridVertex>(), draw);
+	context.plTerrainArray.imageType = SG_IMAGETYPE_ARRAY;
+	context.plTerrainArrayWide.imageType = SG_IMAGETYPE_ARRAY;
+
+	context.instanceBuffer = MakeBuffer(context, {
+		.size = context.instanceCapacity * sizeof(Transform),
+		.type = SG_BUFFERTYPE_VERTEXBUFFER,
+		.usage = SG_USAGE_STREAM,
+	});
+
+	context.txWhite = MakeTextureRGBA(context, 2, 2, { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff });
+	context.txChecker = MakeTextureRGBA(context, 2, 2, { 0xffffffff, 0x000000ff, 0x000000ff, 0xffffffff });
+
+	const uint32_t white[4] = { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff };
+	context.txWhiteArray = { MakeImage(context, {
+		.type = SG_IMAGETYPE_ARRAY,
+		.width = 2,
+		.height = 2,
+		.num_slices = 1,
+		.data = {
+			.subimage = {
+				{ { white, sizeof(white) } }
+			}
+		}
+	}), SG_IMAGETYPE_ARRAY };
 
 	return true;
 }
 
 bool Release(Context& context)
 {
+	context.jobs.reset();
+	context.textures.reset();
+
+	// sg_shutdown destroys whatever is still registered
+	context.resources = {};
 	sg_shutdown();
 
+	lua_close(context.interp);
+	context.interp = nullptr;
+
+#if !defined(SOKOL_DUMMY_BACKEND)
 	SDL_GL_DeleteContext(context.glCtx);
+#endif
 	SDL_DestroyWindow(context.window);
 
 	SDL_Quit();
@@ -436,25 +4306,93 @@ bool Release(Context& context)
 	return true;
 }
 
+namespace {
+
+// sleeps while the deadline is far off and spins the rest
+void WaitUntil(uint64_t deadline, double spinMs)
+{
+	for (uint64_t now = stm_now(); now < deadline; now = stm_now()) {
+		const double left = stm_ms(deadline - now);
+		if (left > spinMs + 1.0)
+			SDL_Delay(Uint32(left - spinMs));
+		else
+			std::this_thread::yield();
+	}
+}
+
+}
+
 int Loop(Context& context, const RunParams& params)
 {
 	unsigned int step = 0;
 	unsigned int frame = 0;
 
-	const unsigned int updateMs = 8;
-	const unsigned int frameMs = 1000 / 100;
+	const uint64_t updateTicks = uint64_t(std::max<uint32_t>(1, params.updateMs)) * 1000000;
+	const uint64_t frameTicks = uint64_t(params.frameMs) * 1000000;
 
-	double updateDuration {};
+	// written by the update side, which is another thread when threaded
+	std::atomic<double> updateDuration {0.0};
 	double frameDuration {};
 	double loopDuration {};
 
+#if !defined(SOKOL_DUMMY_BACKEND)
+	SDL_GL_SetSwapInterval(params.vsync ? 1 : 0);
+#endif
+
 	const uint64_t startTick = stm_now();
 	uint64_t loop = startTick;
-	uint64_t updateTick = startTick;
-	auto elapsed = [&] () -> double { return double(updateTick - startTick) / 100000.0; };
+	// wall clock time consumed by updates, and the simulated time they stand for
+	std::atomic<uint64_t> updateTick{ startTick };
+	std::atomic<uint64_t> simTicks{ 0 };
+	uint64_t frameDeadline = startTick;
+
+	bool scripted = false;
+
+	// runs the steps due at currentTick
+	auto runUpdates = [&] (uint64_t currentTick) {
+		uint64_t tick = updateTick.load(std::memory_order_relaxed);
+		uint32_t steps = 0;
+		while (tick + updateTicks <= currentTick && steps < params.maxSteps) {
+			tick += updateTicks;
+			++step;
+			++steps;
+			PIPO_ZONE("Update");
+			const uint64_t start = stm_now();
+			const uint64_t sim = simTicks.load(std::memory_order_relaxed) + updateTicks;
+			const UpdateParams up{ stm_ms(sim), step, params.updateMs };
+			if (params.update)
+				params.update(context, up);
+			if (scripted)
+				UpdateScripts(context, up, params.scriptBudgetMs);
+			updateDuration.store(0.5 * (updateDuration.load(std::memory_order_relaxed) + stm_ms(stm_since(start))), std::memory_order_relaxed);
+			simTicks.store(sim, std::memory_order_relaxed);
+			updateTick.store(tick, std::memory_order_release);
+		}
+		// after a stall the simulation slows down instead of trying to catch up
+		if (tick + updateTicks <= currentTick)
+			updateTick.store(currentTick - (currentTick - tick) % updateTicks, std::memory_order_release);
+	};
+
+	// collection is stepped by UpdateScripts inside the script budget while a script runs
+	scripted = !params.script.empty() && LoadScript(context, params.script);
+	if (scripted)
+		lua_gc(context.interp, LUA_GCSTOP, 0);
+
+	std::atomic<bool> running{ true };
+	std::thread updater;
+	if (params.threaded) {
+		updater = std::thread([&] {
+			while (running.load(std::memory_order_relaxed)) {
+				WaitUntil(updateTick.load(std::memory_order_relaxed) + updateTicks, params.spinMs);
+				runUpdates(stm_now());
+			}
+		});
+	}
 
-	while(!SDL_QuitRequested()) {
+	while(!SDL_QuitRequested() && (params.frames == 0 || frame < params.frames)) {
 		loopDuration = 0.5 * (loopDuration + stm_ms(stm_laptime(&loop)));
+		ProfileFrame(frame + 1);
+		PIPO_ZONE("Loop");
 
 		SDL_Event e;
 		while (SDL_PollEvent(&e)) {
@@ -468,36 +4406,61 @@ int Loop(Context& context, const RunParams& params)
 			//case SDL_KEYDOWN:
 			//	break;
 			//}
+			if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F9)
+				WriteChromeTrace("trace.json", 120);
 			if (params.event)
 				params.event(context, { e });
 		}
 
 		const uint64_t currentTick = stm_now();
-		while (updateTick < currentTick) {
-			updateTick += updateMs * 1000000;
-			++step;
-			const uint64_t start = stm_now();
-			if (params.update)
-				params.update(context, { elapsed(), step, updateMs });
-			updateDuration = 0.5 * (updateDuration + stm_ms(stm_since(start)));
-		}
+		if (!params.threaded)
+			runUpdates(currentTick);
 
 		{
+			PIPO_ZONE("Draw");
+#if defined(SOKOL_DUMMY_BACKEND)
+			SDL_GetWindowSize(context.window, &context.frameWidth, &context.frameHeight);
+#else
 			SDL_GL_GetDrawableSize(context.window, &context.frameWidth, &context.frameHeight);
+#endif
 			++frame;
+			// threaded, the update may be running late or have finished a step since currentTick
+			const uint64_t tick = updateTick.load(std::memory_order_acquire);
+			const float alpha = currentTick > tick ? std::min(1.0f, float(double(currentTick - tick) / double(updateTicks))) : 0.0f;
+			const double elapsed = stm_ms(simTicks.load(std::memory_order_relaxed));
 			const uint64_t start = stm_now();
 			if (params.draw)
-				params.draw(context, { elapsed() });
+				params.draw(context, { elapsed + alpha * params.updateMs, alpha });
 			frameDuration = 0.5 * (frameDuration + stm_ms(stm_since(start)));
 		}
 
-		SDL_GL_SwapWindow(context.window);
+		{
+			PIPO_ZONE("Swap");
+#if !defined(SOKOL_DUMMY_BACKEND)
+			SDL_GL_SwapWindow(context.window);
+#endif
+		}
+
+		context.timing = { updateDuration.load(std::memory_order_relaxed), frameDuration, loopDuration };
+		CollectProfile(context, frame - 1);
 
-		const unsigned int dt = static_cast<unsigned int>(stm_ms(stm_diff(stm_now(), loop)));
-		if (dt < frameMs)
-			SDL_Delay(frameMs - dt);
+		// a late frame moves the deadline instead of rushing the next ones
+		if (frameTicks > 0) {
+			frameDeadline += frameTicks;
+			const uint64_t now = stm_now();
+			if (frameDeadline < now)
+				frameDeadline = now;
+			else
+				WaitUntil(frameDeadline, params.spinMs);
+		}
 	}
 
+	running.store(false, std::memory_order_relaxed);
+	if (updater.joinable())
+		updater.join();
+	if (scripted)
+		lua_gc(context.interp, LUA_GCRESTART, 0);
+
 	return 0;
 }
 
@@ -1,12 +1,22 @@
 
+#include <cstddef>
 #include <functional>
 #include <optional>
 #include <algorithm>
+#include <string>
 #include <string_view>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <array>
 #include <variant>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <tuple>
 
 #include <SDL2/SDL.h>
 #include <GL/glew.h>
@@ -19,12 +29,18 @@
 #include "tinyddsloader.h"
 #pragma GCC  diagnostic pop
 
+// build with -DPIPO_PROFILE=0 to compile every PIPO_ZONE out
+#ifndef PIPO_PROFILE
+#define PIPO_PROFILE 1
+#endif
+
 namespace pipoengine {
 
 using mat4 = hmm_mat4;
 using vec4 = hmm_vec4;
 using vec3 = hmm_vec3;
 using vec2 = hmm_vec2;
+using quat = hmm_quaternion;
 
 struct Context;
 
@@ -33,6 +49,8 @@ struct Transform
 	mat4 world;
 };
 
+static_assert(sizeof(Transform) == sizeof(mat4), "transforms are streamed as instance data");
+
 struct BaseVertex
 {
 	std::array<float, 3> pos;
@@ -41,16 +59,416 @@ struct BaseVertex
 	uint32_t color{ 0xffffffff };
 };
 
+// terrain sample, position and uv come from a grid buffer shared by every tile of one size
+struct TerrainVertex
+{
+	float height;
+	uint32_t normal;	// xyz, w is layer * 8 + blend with the next layer in 1/7 steps
+};
+
+constexpr int MaxTerrainLayer = 15;
+
+static_assert(sizeof(TerrainVertex) == 8, "terrain samples are 4x smaller than BaseVertex");
+
+struct TerrainGridVertex
+{
+	std::array<float, 4> pos;	// x, y, u, v
+};
+
+// quantized BaseVertex: position is xyz * 2^(w / 32), octahedral normal, uv * 2^(w % 32 - 16);
+// the uv steps are 1/4096 unless the mesh has uvs past +-8, then they grow like positions do
+constexpr int PackedUVExponentMin = -12;
+constexpr int PackedUVExponentMax = 15;
+
+struct PackedVertex
+{
+	std::array<int16_t, 4> pos;
+	std::array<int16_t, 2> normal;
+	std::array<int16_t, 2> uv;
+	uint32_t color{ 0xffffffff };
+};
+
+static_assert(sizeof(PackedVertex) == 20, "packed vertices are 20 bytes instead of 36");
+
+// an empty (min > max) box means unknown extent, such meshes are never culled
+struct Bounds
+{
+	vec3 min{ 1e30f, 1e30f, 1e30f };
+	vec3 max{ -1e30f, -1e30f, -1e30f };
+
+	bool valid() const { return min.X <= max.X && min.Y <= max.Y && min.Z <= max.Z; }
+};
+
+// six inward planes, stored as lanes for the SIMD box test (lanes 6 and 7 repeat near/far)
+struct Frustum
+{
+	alignas(16) float nx[8];
+	alignas(16) float ny[8];
+	alignas(16) float nz[8];
+	alignas(16) float d[8];
+};
+
+enum class Visibility
+{
+	Outside,
+	Intersect,
+	Inside,
+};
+
+// quadtree over a w*h grid of world space boxes, tile (x, y) is index y * w + x
+class TileQuadTree
+{
+public:
+	void build(int w, int h, const std::vector<Bounds>& tiles);
+	void cull(const Frustum& f, std::vector<int>& visible) const;
+
+protected:
+	struct Node
+	{
+		Bounds bounds;
+		int x0, y0, x1, y1;
+		std::array<int, 4> children;
+	};
+
+	std::vector<Node> _nodes;
+	int _width{ 0 };
+};
+
+struct MeshData
+{
+	std::vector<BaseVertex> vertice;
+	std::vector<uint32_t> indice;
+	// false when the source had no normals and BaseVertex::normal holds placeholders
+	bool hasNormals{ true };
+	// empty unless computed, per vertex xyz tangent and w handedness, bitangent = w * cross(normal, tangent)
+	std::vector<std::array<float, 4>> tangents;
+};
+
+// average cache misses per triangle of a FIFO post-transform cache, 0.5 is ideal for grids
+struct MeshOptimizeStats
+{
+	float acmrBefore{ 0.0f };
+	float acmrAfter{ 0.0f };
+};
+
+// meshes whose largest index is above this need 32-bit index buffers and the wide pipelines
+constexpr uint32_t MaxIndex16 = 0xffff;
+
+enum class HeightBorder
+{
+	Clamp,
+	Wrap,
+	Constant,
+};
+
+// dense row-major height samples, stride is in floats
+struct HeightField
+{
+	const float* data{ nullptr };
+	int width{ 0 };
+	int height{ 0 };
+	int stride{ 0 };
+	HeightBorder border{ HeightBorder::Clamp };
+	float borderValue{ 0.0f };
+};
+
+// geomipmapping, level l samples every 1 << l vertices of a tile
+constexpr int HMapMaxLods = 4;
+
+// stitch bits, set when the neighbour on that tile edge is one level coarser
+enum HMapEdge
+{
+	HMapEdgeLeft = 1,
+	HMapEdgeRight = 2,
+	HMapEdgeTop = 4,
+	HMapEdgeBottom = 8,
+};
+
+// worst height error of each level against the full resolution tile
+struct HMapLod
+{
+	int levels{ 1 };
+	std::array<float, HMapMaxLods> error{};
+};
+
+struct MappedFile
+{
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile(MappedFile&& other) noexcept;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+	~MappedFile();
+
+	const uint8_t* data{ nullptr };
+	size_t size{ 0 };
+};
+
+// netpbm P5 (gray) or P6 (rgb) image, samples are bytes up to maxval 255 and big-endian 16-bit above
+struct PPMInfo
+{
+	int width{ 0 };
+	int height{ 0 };
+	int channels{ 0 };
+	int maxval{ 0 };
+	size_t dataOffset{ 0 };
+};
+
+// cooked asset pack: PackHeader, then PackHeader::count entries, then 16-byte aligned blobs
+// each blob starts with the Pack* struct matching its entry type, offsets inside are blob-relative
+
+constexpr uint32_t PackMagic = 0x4b504950; // "PIPK"
+constexpr uint32_t PackVersion = 8;
+constexpr uint32_t PackAlign = 16;
+
+enum class PackEntryType : uint32_t
+{
+	Mesh,
+	Texture,
+	HeightMap,
+	HMapTile,
+};
+
+struct PackHeader
+{
+	uint32_t magic{ PackMagic };
+	uint32_t version{ PackVersion };
+	uint32_t count{ 0 };
+	uint32_t reserved{ 0 };
+};
+
+struct PackEntry
+{
+	std::array<char, 48> name{};
+	PackEntryType type{};
+	uint32_t reserved{ 0 };
+	uint64_t offset{ 0 };
+	uint64_t size{ 0 };
+};
+
+struct PackMesh
+{
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t vertexOffset;
+	uint32_t indexOffset;
+	uint32_t indexSize;
+	// xyzw snorm16 per vertex, 0 when the mesh was cooked without tangents
+	uint32_t tangentOffset;
+	Bounds bounds;
+};
+
+struct PackTexture
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t mips;
+	uint32_t pixelFormat;
+	// array layers, each mip holds all slices back to back
+	uint32_t slices;
+	std::array<uint32_t, SG_MAX_MIPMAPS> mipOffset;
+	std::array<uint32_t, SG_MAX_MIPMAPS> mipSize;
+};
+
+struct PackHeightMap
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t dataOffset;
+	uint32_t reserved;
+};
+
+struct PackHMapTile
+{
+	int32_t ox;
+	int32_t oy;
+	int32_t w;
+	int32_t h;
+	vec2 min;
+	vec2 max;
+	uint32_t vertexOffset;
+	uint32_t reserved;
+	Bounds bounds;
+};
+
+struct Pack
+{
+	MappedFile file;
+	const PackEntry* entries{ nullptr };
+	uint32_t count{ 0 };
+
+	const PackEntry* find(std::string_view name, PackEntryType type) const;
+
+	const uint8_t* data(const PackEntry& entry, uint32_t offset = 0) const
+	{
+		return file.data + entry.offset + offset;
+	}
+
+	bool contains(const PackEntry& entry, uint64_t offset, uint64_t size) const
+	{
+		return offset <= entry.size && size <= entry.size - offset;
+	}
+
+	template <typename T>
+	const T* get(const PackEntry& entry) const
+	{
+		return contains(entry, 0, sizeof(T)) ? reinterpret_cast<const T*>(data(entry)) : nullptr;
+	}
+};
+
+// fixed pool of worker threads, jobs are plain callables run in submission order
+class JobSystem
+{
+public:
+	explicit JobSystem(int workers = -1);
+	~JobSystem();
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	void run(std::function<void()> job);
+	// calls fn(i) for i in [0, count), the calling thread takes part and returns once all are done
+	void parallelFor(int count, const std::function<void(int)>& fn);
+
+	int workerCount() const { return int(_threads.size()); }
+
+protected:
+	void work();
+
+	std::vector<std::thread> _threads;
+	std::deque<std::function<void()>> _jobs;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	bool _quit{ false };
+};
+
+// parented transforms, local translation / rotation / scale live in structure of arrays kept in
+// topological order (a parent always sits before its children) so one forward pass resolves them;
+// world() follows the same order and goes straight to DrawMeshInstanced or culling
+class TransformHierarchy
+{
+public:
+	static constexpr int None = -1;
+
+	// the returned handle stays valid until removed, the parent must already exist;
+	// nodes added one after the other stay adjacent in world()
+	int add(int parent = None, vec3 translation = { 0, 0, 0 }, quat rotation = HMM_Quaternion(0, 0, 0, 1), vec3 scale = { 1, 1, 1 });
+	// drops the node with all of its descendants, linear in the node count;
+	// handles already gone are ignored until add hands them out again
+	void remove(int handle);
+	void reserve(int count);
+
+	void setTranslation(int handle, vec3 t);
+	// normalized on the way in
+	void setRotation(int handle, quat r);
+	void setScale(int handle, vec3 s);
+	vec3 translation(int handle) const;
+	quat rotation(int handle) const;
+	vec3 scale(int handle) const;
+	int parent(int handle) const;
+
+	// world matrices of changed nodes and everything below them, four nodes at a time;
+	// nothing is done when nothing changed
+	void update();
+
+	int index(int handle) const { return _index[handle]; }
+	const Transform& world(int handle) const { return _world[_index[handle]]; }
+	const std::vector<Transform>& world() const { return _world; }
+	int size() const { return int(_world.size()); }
+
+protected:
+	void markDirty(int i);
+	mat4 local(int i) const;
+
+	// per node, in topological order
+	std::vector<int> _parent;
+	std::vector<float> _tx, _ty, _tz;
+	std::vector<float> _rx, _ry, _rz, _rw;
+	std::vector<float> _sx, _sy, _sz;
+	std::vector<uint8_t> _dirty;
+	std::vector<Transform> _world;
+	std::vector<int> _handle;
+	bool _changed{ false };
+
+	// per handle, None once removed
+	std::vector<int> _index;
+	std::vector<int> _free;
+};
+
+// single writer, single reader, lock-free: the writer fills back() and publishes it whole,
+// the reader swaps in the latest published slot and reads it until the next consume
+template <typename T>
+class TripleBuffer
+{
+public:
+	T& back() { return _slots[_back]; }
+	void publish()
+	{
+		_back = _shared.exchange(uint8_t(_back | Fresh), std::memory_order_acq_rel) & Slot;
+	}
+
+	// false when nothing was published since the last call, front() stays as is
+	bool consume()
+	{
+		if (!(_shared.load(std::memory_order_relaxed) & Fresh))
+			return false;
+		_front = _shared.exchange(_front, std::memory_order_acq_rel) & Slot;
+		return true;
+	}
+	const T& front() const { return _slots[_front]; }
+
+protected:
+	static constexpr uint8_t Slot = 3;
+	static constexpr uint8_t Fresh = 4;
+
+	std::array<T, 3> _slots{};
+	uint8_t _back{ 0 };
+	std::atomic<uint8_t> _shared{ 1 };
+	uint8_t _front{ 2 };
+};
+
 struct Pipeline
 {
 	sg_pipeline pl{};
 	std::function<void(const Context& ctx)> frame{};
 	std::function<void(const Transform&)> draw{};
+	Pipeline* instanced{ nullptr };
+	// same shader and layout with 32-bit indices
+	Pipeline* wide{ nullptr };
+	// kind of texture the shader samples, picks the fallback of streaming textures
+	sg_image_type imageType{ SG_IMAGETYPE_2D };
 };
 
 struct Texture
 {
 	sg_image iid{};
+	// known before an async upload lands, array textures need an array sampler
+	sg_image_type type{ SG_IMAGETYPE_2D };
+};
+
+// a texture read and decoded off the render thread, mip data is packed in data
+struct PendingTexture
+{
+	sg_image image{};
+	bool ok{ false };
+	int width{ 0 };
+	int height{ 0 };
+	int mips{ 0 };
+	int slices{ 1 };
+	sg_image_type type{ SG_IMAGETYPE_2D };
+	sg_pixel_format format{ _SG_PIXELFORMAT_DEFAULT };
+	std::array<size_t, SG_MAX_MIPMAPS> mipOffset{};
+	std::array<size_t, SG_MAX_MIPMAPS> mipSize{};
+	std::vector<uint8_t> data;
+};
+
+// async textures are allocated up front and drawn with txWhite (txWhiteArray) until their upload
+struct TextureStream
+{
+	std::mutex mutex;
+	std::deque<PendingTexture> ready;
+	int inflight{ 0 };
+	// bytes created per frame, one texture always goes through so large ones cannot stall
+	size_t budget{ 4u << 20 };
 };
 
 struct Mesh
@@ -62,6 +480,265 @@ struct Mesh
 	sg_buffer vid{};
 	sg_buffer iid{};
 	int pcount{0};
+
+	Bounds bounds{};
+
+	// second vertex stream, the shared grid of terrain tiles
+	sg_buffer grid{};
+};
+
+// terrain following, picking and line of sight over a HeightField whose sample (i, j) sits at
+// origin + (i, j) * spacing, heights are z; the field's data must outlive the query
+class HeightQuery
+{
+public:
+	HeightQuery() = default;
+	// a field without data or under 2x2 samples behaves like the default query
+	HeightQuery(const HeightField& field, vec2 origin, vec2 spacing);
+
+	// bilinear between the four surrounding samples, the field's border rule applies outside
+	float height(vec2 p) const;
+	vec3 normal(vec2 p) const;
+	// n points at once, either output may be null, clamped fields take the simd path
+	void sample(const vec2* p, int n, float* heights, vec3* normals) const;
+
+	// smallest t in [0, maxT] where origin + t * dir meets the surface, dir needs no normalizing
+	std::optional<float> raycast(vec3 origin, vec3 dir, float maxT) const;
+	// false when the terrain is in between
+	bool visible(vec3 a, vec3 b) const { return !raycast(a, b - a, 1.0f); }
+
+protected:
+	struct MinMax
+	{
+		float lo;
+		float hi;
+	};
+
+	struct Level
+	{
+		int w{ 0 };
+		int h{ 0 };
+		std::vector<MinMax> cells;
+	};
+
+	float at(int x, int y) const;
+	void corners(int x, int y, float c[4]) const;
+
+	HeightField _field{};
+	vec2 _origin{ 0, 0 };
+	vec2 _spacing{ 1, 1 };
+	vec2 _inv{ 1, 1 };
+	// level 0 bounds each cell between four samples, level l bounds 2^l x 2^l cells, the last is 1x1
+	std::vector<Level> _levels;
+};
+
+// keeps at most capacity terrain tiles resident, missing tiles are built on the job system
+// and vertex buffers are recycled least recently used first
+class TerrainPager
+{
+public:
+	// returns the tileSize * tileSize samples of a tile, runs on worker threads
+	using BuildFn = std::function<std::vector<TerrainVertex>(int tile)>;
+
+	TerrainPager(Context& ctx, int tileCount, int tileSize, vec2 min, vec2 max, int capacity, BuildFn build);
+	// skips builds that have not started and waits for the running ones, build may capture its owner
+	~TerrainPager();
+	TerrainPager(const TerrainPager&) = delete;
+	TerrainPager& operator=(const TerrainPager&) = delete;
+
+	// wanted is sorted by priority, tiles past capacity are ignored; call once per frame
+	void update(const std::vector<int>& wanted);
+	// nullptr while the tile is not resident
+	const Mesh* find(int tile) const;
+
+	int resident() const;
+	int building() const { return _inflight; }
+
+	int uploadsPerFrame{ 8 };
+	int maxInflight{ 64 };
+
+protected:
+	struct Slot
+	{
+		int tile{ -1 };
+		uint64_t used{ 0 };
+		Mesh mesh{};
+	};
+
+	struct Built
+	{
+		int tile;
+		std::vector<TerrainVertex> vertice;
+	};
+
+	// jobs still hold it for a moment after handing their last tile over
+	struct Shared
+	{
+		std::mutex mutex;
+		std::condition_variable done;
+		std::deque<Built> ready;
+		BuildFn build;
+		bool cancelled{ false };
+	};
+
+	int acquire() const;
+
+	Context* _ctx{ nullptr };
+	std::shared_ptr<Shared> _shared;
+	int _tileSize{ 0 };
+	vec2 _min{};
+	vec2 _max{};
+	uint64_t _frame{ 0 };
+	int _inflight{ 0 };
+	std::vector<Slot> _slots;
+	std::vector<int> _slotOf;
+	std::vector<uint64_t> _wanted;
+	std::vector<bool> _building;
+};
+
+struct DrawPacket
+{
+	uint64_t key{ 0 };
+	Mesh mesh{};
+	int first{ 0 };
+	int count{ 0 };
+	bool instanced{ false };
+};
+
+// draws recorded during RenderMain, sorted on pipeline, texture, view depth then buffers
+struct RenderQueue
+{
+	struct SortItem
+	{
+		uint64_t key;
+		uint32_t index;
+	};
+
+	bool enabled{ true };
+	bool active{ false };
+	std::vector<DrawPacket> packets;
+	std::vector<Transform> transforms;
+	std::vector<SortItem> order;
+	std::vector<SortItem> scratch;
+};
+
+// one closed PIPO_ZONE, name has to be a string literal
+struct ProfileZone
+{
+	const char* name;
+	uint64_t start;
+	uint64_t end;
+	uint32_t frame;
+};
+
+// written by its thread only, readers copy and then drop what was overwritten meanwhile
+struct ProfileRing
+{
+	static constexpr uint32_t Size = 1 << 14;
+
+	std::array<ProfileZone, Size> zones;
+	std::atomic<uint32_t> head{ 0 };
+	int thread{ 0 };
+};
+
+// zones of one name summed over the last frame, all threads
+struct ProfileStat
+{
+	const char* name;
+	int calls;
+	double ms;
+};
+
+// smoothed over frames, in ms
+struct FrameTiming
+{
+	double update{ 0.0 };
+	double frame{ 0.0 };
+	double loop{ 0.0 };
+};
+
+void ProfileRecord(const char* name, uint64_t start, uint64_t end);
+
+class ProfileScope
+{
+public:
+	explicit ProfileScope(const char* name) : _name(name), _start(stm_now()) {}
+	~ProfileScope() { ProfileRecord(_name, _start, stm_now()); }
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
+protected:
+	const char* _name;
+	uint64_t _start;
+};
+
+#if PIPO_PROFILE
+#define PIPO_ZONE_JOIN2(a, b) a##b
+#define PIPO_ZONE_JOIN(a, b) PIPO_ZONE_JOIN2(a, b)
+#define PIPO_ZONE(name) ::pipoengine::ProfileScope PIPO_ZONE_JOIN(pipoZone, __LINE__)(name)
+#else
+#define PIPO_ZONE(name) (void)0
+#endif
+
+struct RenderStats
+{
+	int packets{ 0 };
+	int draws{ 0 };
+	int pipelineChanges{ 0 };
+	int pipelineSkipped{ 0 };
+	int bindingChanges{ 0 };
+	int bindingSkipped{ 0 };
+	int culled{ 0 };
+	int triangles{ 0 };
+	int textureUploads{ 0 };
+	size_t textureBytes{ 0 };
+};
+
+enum class ResourceKind
+{
+	Vertex,
+	Index,
+	Texture,
+	Count,
+};
+
+// buffers and images made through the engine, refcounted and destroyed once no frame can use them
+struct ResourceRegistry
+{
+	struct Entry
+	{
+		ResourceKind kind{ ResourceKind::Vertex };
+		sg_usage usage{ SG_USAGE_IMMUTABLE };
+		size_t bytes{ 0 };
+		int refs{ 0 };
+	};
+
+	struct Retired
+	{
+		uint32_t id;
+		bool image;
+		uint64_t frame;
+	};
+
+	std::unordered_map<uint32_t, Entry> buffers;
+	std::unordered_map<uint32_t, Entry> images;
+	std::vector<Retired> retired;
+	// released dynamic and stream buffers waiting for a MakeBuffer of the same kind, usage and size
+	std::map<std::tuple<ResourceKind, sg_usage, size_t>, std::vector<sg_buffer>> pool;
+	size_t poolBudget{ 16u << 20 };
+	size_t pooledBytes{ 0 };
+	std::array<size_t, size_t(ResourceKind::Count)> bytes{};
+	uint64_t frame{ 0 };
+	// frames a released resource survives, 1 waits for the end of the frame that released it
+	int framesInFlight{ 1 };
+};
+
+// written by UpdateScripts, which runs on the update thread when Loop is threaded
+struct ScriptStats
+{
+	std::atomic<double> scriptMs{ 0.0 };
+	std::atomic<double> gcMs{ 0.0 };
+	std::atomic<size_t> memoryKb{ 0 };
 };
 
 struct Context
@@ -74,16 +751,50 @@ struct Context
 	mat4 view;
 	mat4 proj;
 	vec3 lightdir;
+	vec3 eye{};
+	Frustum frustum{};
+	bool cullEnabled{ true };
+	std::vector<Transform> cullScratch;
 
-	std::map<std::pair<int, int>, std::pair<sg_buffer, int>> hmapIndexBuffer;
+	// keyed by w, h, level and stitch mask
+	std::map<std::array<int, 4>, std::pair<sg_buffer, int>> hmapIndexBuffer;
+	std::map<std::tuple<int, int, float, float, float, float>, sg_buffer> hmapGridBuffer;
 
 	lua_State* interp{ nullptr };
+	ScriptStats scripts;
+
+	std::unique_ptr<JobSystem> jobs;
+	std::unique_ptr<TextureStream> textures;
+	ResourceRegistry resources;
 
 	Pipeline plDefault{};
+	Pipeline plInstanced{};
+	Pipeline plTerrain{};
+	Pipeline plPacked{};
+	Pipeline plPackedInstanced{};
+	Pipeline plTerrainArray{};
+	Pipeline plDefaultWide{};
+	Pipeline plInstancedWide{};
+	Pipeline plTerrainWide{};
+	Pipeline plPackedWide{};
+	Pipeline plPackedInstancedWide{};
+	Pipeline plTerrainArrayWide{};
 	Texture txWhite{};
+	Texture txWhiteArray{};
 	Texture txChecker{};
 
 	sg_pipeline lastPip{};
+	sg_bindings lastBindings{};
+
+	RenderQueue queue;
+	RenderStats stats;
+	FrameTiming timing;
+	// last finished frame, slowest first
+	std::vector<ProfileStat> profile;
+
+	sg_buffer instanceBuffer{};
+	int instanceCapacity{ 16384 };
+	int instanceCount{ 0 };
 };
 
 struct InitParams
@@ -94,6 +805,7 @@ struct ReleaseParams
 {
 };
 
+// elapsed is simulated time in ms, it only advances by updateMs steps
 struct UpdateParams
 {
 	const double elapsed;
@@ -101,9 +813,11 @@ struct UpdateParams
 	const uint32_t updateMs;
 };
 
+// alpha in [0, 1) is how far the frame is past the last update, blend the last two states with it
 struct DrawParams
 {
 	const double elapsed;
+	const float alpha;
 };
 
 struct EventParams
@@ -111,50 +825,215 @@ struct EventParams
 	const SDL_Event& evt;
 };
 
-template <class T>
-int attrOffset(T)
+struct VertexAttr
 {
-	return 0;
-}
+	int offset;
+	sg_vertex_format format;
+};
+
+// attributes of a vertex struct in shader declaration order, specialised for every streamed type
+template <typename V>
+struct VertexFormat;
 
-template <typename S>
-struct AttrInfo
+template <>
+struct VertexFormat<BaseVertex>
 {
-	template <typename T, size_t N>
-	static int offset(std::array<T, N> S::*m)
-	{
-		S* ptr = nullptr;
-		std::array<T, N>* mptr = &(ptr->*m);
-		return int((uint8_t*)mptr - (uint8_t*)ptr);
+	static constexpr sg_vertex_step step = SG_VERTEXSTEP_PER_VERTEX;
+	static constexpr std::array<VertexAttr, 4> attrs{ {
+		{ int(offsetof(BaseVertex, pos)), SG_VERTEXFORMAT_FLOAT3 },
+		{ int(offsetof(BaseVertex, normal)), SG_VERTEXFORMAT_FLOAT3 },
+		{ int(offsetof(BaseVertex, uv)), SG_VERTEXFORMAT_FLOAT2 },
+		{ int(offsetof(BaseVertex, color)), SG_VERTEXFORMAT_UBYTE4N },
+	} };
+};
+
+template <>
+struct VertexFormat<PackedVertex>
+{
+	static constexpr sg_vertex_step step = SG_VERTEXSTEP_PER_VERTEX;
+	static constexpr std::array<VertexAttr, 4> attrs{ {
+		{ int(offsetof(PackedVertex, pos)), SG_VERTEXFORMAT_SHORT4 },
+		{ int(offsetof(PackedVertex, normal)), SG_VERTEXFORMAT_SHORT2N },
+		{ int(offsetof(PackedVertex, uv)), SG_VERTEXFORMAT_SHORT2 },
+		{ int(offsetof(PackedVertex, color)), SG_VERTEXFORMAT_UBYTE4N },
+	} };
+};
+
+template <>
+struct VertexFormat<TerrainVertex>
+{
+	static constexpr sg_vertex_step step = SG_VERTEXSTEP_PER_VERTEX;
+	static constexpr std::array<VertexAttr, 2> attrs{ {
+		{ int(offsetof(TerrainVertex, height)), SG_VERTEXFORMAT_FLOAT },
+		{ int(offsetof(TerrainVertex, normal)), SG_VERTEXFORMAT_BYTE4N },
+	} };
+};
+
+template <>
+struct VertexFormat<TerrainGridVertex>
+{
+	static constexpr sg_vertex_step step = SG_VERTEXSTEP_PER_VERTEX;
+	static constexpr std::array<VertexAttr, 1> attrs{ {
+		{ int(offsetof(TerrainGridVertex, pos)), SG_VERTEXFORMAT_FLOAT4 },
+	} };
+};
+
+template <>
+struct VertexFormat<Transform>
+{
+	static constexpr sg_vertex_step step = SG_VERTEXSTEP_PER_INSTANCE;
+	static constexpr std::array<VertexAttr, 4> attrs{ {
+		{ 0 * int(sizeof(vec4)), SG_VERTEXFORMAT_FLOAT4 },
+		{ 1 * int(sizeof(vec4)), SG_VERTEXFORMAT_FLOAT4 },
+		{ 2 * int(sizeof(vec4)), SG_VERTEXFORMAT_FLOAT4 },
+		{ 3 * int(sizeof(vec4)), SG_VERTEXFORMAT_FLOAT4 },
+	} };
+};
+
+constexpr int VertexFormatSize(sg_vertex_format format)
+{
+	switch (format) {
+	case SG_VERTEXFORMAT_FLOAT: return 4;
+	case SG_VERTEXFORMAT_FLOAT2: return 8;
+	case SG_VERTEXFORMAT_FLOAT3: return 12;
+	case SG_VERTEXFORMAT_FLOAT4: return 16;
+	case SG_VERTEXFORMAT_SHORT4:
+	case SG_VERTEXFORMAT_SHORT4N:
+	case SG_VERTEXFORMAT_USHORT4N: return 8;
+	default: return 4;
 	}
-	template <typename T>
-	static int offset(T S::*m)
-	{
-		S* ptr = nullptr;
-		T* mptr = &(ptr->*m);
-		return int((uint8_t*)mptr - (uint8_t*)ptr);
+}
+
+template <typename V>
+constexpr bool VertexFormatFits()
+{
+	for (const VertexAttr& a : VertexFormat<V>::attrs) {
+		if (a.offset < 0 || a.offset + VertexFormatSize(a.format) > int(sizeof(V)))
+			return false;
 	}
-};
+	return true;
+}
 
-Pipeline MakePipeline(Context&, const sg_shader_desc* (*fn)(), std::function<void(const Context& ctx)> frame, std::function<void(const Transform&)> draw);
+// buffer slot i streams the i-th type, attributes are numbered across all of them in order
+template <typename... V>
+constexpr sg_layout_desc VertexLayout()
+{
+	static_assert((VertexFormatFits<V>() && ...), "vertex attribute outside of its struct");
 
-Texture MakeTextureRGBA(int w, int h, const std::vector<uint32_t>& data);
-std::optional<Texture> LoadDDS(const std::vector<std::string>& arrayItems);
-void LoadPPM(
-	std::string_view path,
-	const std::function<void (int, int)>& init,
-	const std::function<void (std::array<float, 3>)>& pix
-);
+	sg_layout_desc layout{};
+	int buffer = 0;
+	int attr = 0;
+	auto add = [&] (int stride, sg_vertex_step step, const auto& attrs) {
+		layout.buffers[buffer].stride = stride;
+		layout.buffers[buffer].step_func = step;
+		layout.buffers[buffer].step_rate = 1;
+		for (const VertexAttr& a : attrs) {
+			layout.attrs[attr].buffer_index = buffer;
+			layout.attrs[attr].offset = a.offset;
+			layout.attrs[attr].format = a.format;
+			++attr;
+		}
+		++buffer;
+	};
+	(add(int(sizeof(V)), VertexFormat<V>::step, VertexFormat<V>::attrs), ...);
+	return layout;
+}
+
+Bounds ComputeBounds(const std::vector<BaseVertex>& vertice);
+Bounds ComputeBounds(const std::vector<PackedVertex>& vertice);
+std::vector<PackedVertex> PackVertices(const std::vector<BaseVertex>& vertice);
+std::vector<std::array<int16_t, 4>> PackTangents(const std::vector<std::array<float, 4>>& tangents);
+BaseVertex UnpackVertex(const PackedVertex& v);
+Bounds TransformBounds(const Bounds& b, const mat4& m);
+Bounds MergeBounds(const Bounds& a, const Bounds& b);
+Frustum MakeFrustum(const mat4& viewProj);
+Visibility TestBounds(const Frustum& f, const Bounds& b);
+
+std::optional<MappedFile> MapFile(std::string_view path);
+std::optional<Pack> OpenPack(std::string_view path);
+
+Pipeline MakePipeline(Context&, const sg_shader_desc* (*fn)(sg_backend), const sg_layout_desc& layout, sg_index_type indexType, std::function<void(const Context& ctx)> frame, std::function<void(const Transform&)> draw);
+
+// made with one reference held by the caller, see ReleaseBuffer / ReleaseImage
+sg_buffer MakeBuffer(Context& ctx, const sg_buffer_desc& desc);
+sg_image MakeImage(Context& ctx, const sg_image_desc& desc);
+void RetainBuffer(Context& ctx, sg_buffer buffer);
+void ReleaseBuffer(Context& ctx, sg_buffer buffer);
+void RetainImage(Context& ctx, sg_image image);
+void ReleaseImage(Context& ctx, sg_image image);
+// a mesh holds references on its vertex, index and grid buffers, not on its texture
+void RetainMesh(Context& ctx, const Mesh& mesh);
+void ReleaseMesh(Context& ctx, const Mesh& mesh);
+void RetainTexture(Context& ctx, const Texture& tex);
+void ReleaseTexture(Context& ctx, const Texture& tex);
+// destroys or pools what was released framesInFlight frames ago, RenderMain calls it after sg_commit
+void CollectResources(Context& ctx);
+// live bytes, pooled buffers are not counted
+size_t ResourceBytes(const Context& ctx, ResourceKind kind);
 
+Texture MakeTextureRGBA(Context& ctx, int w, int h, const std::vector<uint32_t>& data);
+// SG_PIXELFORMAT_NONE when sokol has no matching format, srgb formats are read as linear
+sg_pixel_format DDSPixelFormat(tinyddsloader::DDSFile::DXGIFormat format);
+// the item list always makes an SG_IMAGETYPE_ARRAY texture, one slice per item (or the slices of
+// a single dds array); a single path makes a 2D texture and fails on dds arrays
+std::optional<Texture> LoadDDS(Context& ctx, const std::vector<std::string>& arrayItems);
+Texture LoadTextureAsync(Context& ctx, const std::string& path);
+Texture LoadTextureAsync(Context& ctx, const std::vector<std::string>& arrayItems);
+// the pack has to stay mapped until PendingTextures drops to zero
+std::optional<Texture> LoadTextureAsync(Context& ctx, const Pack& pack, std::string_view name);
+int UploadTextures(Context& ctx);
+int PendingTextures(Context& ctx);
+std::optional<PPMInfo> ParsePPMHeader(const uint8_t* data, size_t size);
+// one channel of every pixel as scale * sample / maxval + bias, dst is resized to width * height
+// rows are converted on the workers of jobs when one is given
+std::optional<PPMInfo> LoadPPM(std::string_view path, std::vector<float>& dst, const float scale = 1.0f, const float bias = 0.0f, const int channel = 0, JobSystem* jobs = nullptr);
+
+// prebuilt buffers get a reference of their own, the caller keeps its one
 Mesh MakeMesh(
 	Context& context,
-	const std::variant<sg_buffer, std::vector<BaseVertex>>& vertice,
-	const std::variant<std::pair<sg_buffer, int>, std::vector<uint16_t>>& indice
+	const std::variant<sg_buffer, std::vector<BaseVertex>, std::vector<PackedVertex>>& vertice,
+	const std::variant<std::pair<sg_buffer, int>, std::vector<uint16_t>, std::vector<uint32_t>>& indice
 );
+std::vector<MeshData> SplitMesh(const MeshData& mesh, const size_t maxVertices = MaxIndex16 + 1);
+float ComputeACMR(const std::vector<uint32_t>& indice, const size_t vertexCount, const int cacheSize = 16);
+void OptimizeVertexCache(std::vector<uint32_t>& indice, const size_t vertexCount);
+void OptimizeOverdraw(std::vector<uint32_t>& indice, const std::vector<BaseVertex>& vertice, const float threshold = 1.05f);
+void OptimizeVertexFetch(MeshData& mesh);
+MeshOptimizeStats OptimizeMesh(MeshData& mesh);
+// area and angle weighted, triangle ranges run on the workers of jobs when one is given
+void ComputeNormals(MeshData& mesh, JobSystem* jobs = nullptr);
+// from the uvs and the current normals, MikkTSpace conventions: angle weighted, orthogonal to the normal
+void ComputeTangents(MeshData& mesh, JobSystem* jobs = nullptr);
+std::vector<BaseVertex> BuildHMap(const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const std::function<float(int, int)>& f);
+std::vector<BaseVertex> BuildHMap(const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const HeightField& field);
+std::pair<sg_buffer, int> HMapIndexBuffer(Context& ctx, const int w, const int h, const int level = 0, const int stitch = 0);
+HMapLod ComputeHMapLod(const int ox, const int oy, const int w, const int h, const HeightField& field);
+int SelectHMapLod(const Context& ctx, const HMapLod& lod, const Bounds& bounds, const float pixelError);
+void BalanceHMapLods(std::vector<int>& levels, const int w, const int h);
+int HMapStitch(const int level, const int left, const int right, const int top, const int bottom);
+Mesh UploadHMap(Context& ctx, const int w, const int h, const std::vector<BaseVertex>& vertice);
+// layer picks the texture array layer of each sample (up to MaxTerrainLayer), fractions blend with the next layer in 1/7 steps
+std::vector<TerrainVertex> CompactHMap(const std::vector<BaseVertex>& vertice, const std::function<float(const BaseVertex&)>& layer = {});
+sg_buffer HMapGridBuffer(Context& ctx, const int w, const int h, const vec2 min, const vec2 max);
+Mesh UploadTerrain(Context& ctx, const int w, const int h, const vec2 min, const vec2 max, const std::vector<TerrainVertex>& vertice);
+// draws the tile with a texture array indexed by the per-sample layer, a 2D texture keeps the plain terrain pipeline
+void SetTerrainLayers(Context& ctx, Mesh& mesh, const Texture& layers);
 Mesh MakeHMap(Context& ctx, const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const std::function<float(int, int)>& f);
+Mesh MakeHMap(Context& ctx, const int ox, const int oy, const int w, const int h, const vec2 min, const vec2 max, const HeightField& field);
+std::optional<MeshData> ParsePLY(std::string_view path);
 std::optional<Mesh> LoadMesh(Context& context, std::string_view path);
+std::vector<Mesh> LoadSubmeshes(Context& context, std::string_view path);
+std::optional<Mesh> LoadMesh(Context& context, const Pack& pack, std::string_view name);
+std::optional<Texture> LoadTexture(Context& ctx, const Pack& pack, std::string_view name);
+std::optional<Mesh> LoadHMap(Context& context, const Pack& pack, std::string_view name);
 
+// queued while a RenderMain frame is recording, drawn immediately otherwise
 void DrawMesh(Context& ctx, const Mesh& mesh, const Transform& t);
+// one draw call for all transforms, instances are streamed to a per-frame vertex buffer
+void DrawMeshInstanced(Context& ctx, const Mesh& mesh, const Transform* transforms, int count);
+void DrawMeshInstanced(Context& ctx, const Mesh& mesh, const std::vector<Transform>& transforms);
+
+void FlushRenderQueue(Context& ctx);
 
 void SetCamera(Context& ctx, const mat4& proj, const mat4& view);
 void SetLight(Context& ctx, const vec3& lightdir);
@@ -166,16 +1045,54 @@ struct RunParams
 	std::function<bool(Context&, const DrawParams&)> draw {};
 	std::function<bool(Context&, const ReleaseParams&)> release {};
 	std::function<bool(Context&, const EventParams&)> event {};
+	// fixed simulation step
+	uint32_t updateMs {8};
+	// frame deadline, 0 leaves pacing to vsync or runs unpaced
+	uint32_t frameMs {10};
+	// updates per frame before the backlog is dropped, so a stall cannot spiral
+	uint32_t maxSteps {5};
+	// the last part of the frame wait is spun instead of slept, SDL_Delay is too coarse for it
+	double spinMs {2.0};
+	bool vsync {true};
+	// update runs on its own thread, state it shares with draw must go through a TripleBuffer
+	// draw keeps the calling thread and so the gl context, event still runs before it;
+	// SDL input state is only safe to read there, update has to work from a copy taken in event
+	bool threaded {false};
+	// stop after that many frames, 0 runs until quit
+	uint32_t frames {0};
+	// lua file loaded when Loop starts, its update(step, elapsed, dt) runs after update on every step;
+	// while it runs the gc is stopped and only stepped by UpdateScripts
+	std::string script {};
+	// script time per step, the incremental gc only gets what the script left of it
+	double scriptBudgetMs {2.0};
 };
 
 bool Init(Context& context);
 bool Release(Context& context);
+
+// lua gameplay: engine arrays show up as pipo.<name> with bulk methods, so one call covers
+// thousands of entities, see BindScriptLib in pipoengine.cpp for the methods
+// once a threaded Loop runs, context.interp belongs to the update thread
+bool LoadScript(Context& ctx, std::string_view path);
+// the caller owns the arrays, rebind after they move, rebinding a name updates the script's view in place
+void BindTransforms(Context& ctx, std::string_view name, Transform* data, int count);
+void BindMeshIds(Context& ctx, std::string_view name, int32_t* data, int count);
+// calls the script's update, then steps the gc by what it allocated and further while budgetMs lasts
+bool UpdateScripts(Context& ctx, const UpdateParams& params, double budgetMs);
+
+// zones recorded from now on belong to frame
+void ProfileFrame(uint32_t frame);
+// fills ctx.profile from the zones of frame
+void CollectProfile(Context& ctx, uint32_t frame);
+// chrome://tracing / Perfetto trace_event json of the last frames frames, F9 in Loop writes trace.json
+bool WriteChromeTrace(std::string_view path, int frames);
 int Loop(Context& context, const RunParams& params);
 int Exec(const RunParams& params);
 
 template <class FN>
 void RenderMain(Context& ctx, const FN& fn)
 {
+	PIPO_ZONE("RenderMain");
 	const float c = 0.2f;
 	sg_begin_default_pass({
 			.colors = { { SG_ACTION_CLEAR, { c, c, c, 1.0f } } }
@@ -185,11 +1102,21 @@ void RenderMain(Context& ctx, const FN& fn)
 	);
 
 	ctx.lastPip = { ~0u };
+	ctx.lastBindings = {};
+	ctx.instanceCount = 0;
+	ctx.stats = {};
+	ctx.queue.active = ctx.queue.enabled;
+
+	UploadTextures(ctx);
 
 	fn(ctx.frameWidth, ctx.frameHeight);
 
+	FlushRenderQueue(ctx);
+
 	sg_end_pass();
 	sg_commit();
+
+	CollectResources(ctx);
 }
 
 }